@@ -0,0 +1,74 @@
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <cxxopts.hpp>
+
+#include <chip8/chip8.h>
+#include <chip8/translator.h>
+
+namespace fs = std::filesystem;
+
+int main(int argc, char* argv[])
+try {
+    cxxopts::Options options{argv[0], "Translates a ROM to C++ for the native engine"};
+    options.add_options()
+        ("p,path", "Path to the ROM file", cxxopts::value<std::string>())
+        ("o,output", "C++ file to write", cxxopts::value<std::string>())
+        ("q,quirks", fmt::format("Interpreter quirks ({})", Chip8Cpu::quirks_names()), cxxopts::value<std::string>()->default_value("chip8"))
+        ("e,entry", "Further entry point in hex, e.g. a BNNN target", cxxopts::value<std::vector<std::string>>())
+        ("t,trace", "Frames to run the ROM on the interpreter first to find BNNN targets", cxxopts::value<std::uint64_t>()->default_value("600"))
+        ("symbol", "Name of the NativeProgram the file defines", cxxopts::value<std::string>()->default_value("translated_rom"))
+        ("h,help", "Print help")
+    ;
+
+    auto opts = options.parse(argc, argv);
+    if (opts.count("help") || !opts.count("path") || !opts.count("output")) {
+        fmt::print("{}\n", options.help({""}));
+        return opts.count("help") ? 0 : 1;
+    }
+
+    const auto quirks_name = opts["quirks"].as<std::string>();
+    const auto quirks = Chip8Cpu::parse_quirks(quirks_name);
+    if (!quirks) {
+        fmt::fprintf(stderr, "Error: unknown quirks \"%s\"\n", quirks_name);
+        return 1;
+    }
+
+    const fs::path path = opts["path"].as<std::string>();
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        throw FileNotFoundException(path.u8string());
+    }
+    const std::vector<std::uint8_t> rom{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+
+    auto entries = Translator::trace_jumps(rom, *quirks, opts["trace"].as<std::uint64_t>());
+    if (opts.count("entry")) {
+        for (const auto& entry : opts["entry"].as<std::vector<std::string>>()) {
+            entries.push_back(static_cast<std::uint16_t>(std::stoul(entry, nullptr, 16)));
+        }
+    }
+
+    const Translator translator{rom, *quirks, entries};
+    const auto output = opts["output"].as<std::string>();
+    std::ofstream out{output};
+    translator.write(out, opts["symbol"].as<std::string>(), path.filename().u8string());
+    if (!out) {
+        throw IOException("Can't write file {}", output);
+    }
+
+    fmt::print("{}: {} blocks, {} instructions\n", path.filename().u8string(), translator.blocks(), translator.instructions());
+    return 0;
+} catch (const Exception& e) {
+    fmt::fprintf(stderr, "Error: %s: %s\n", e.what(), std::string{e.message()});
+    return 1;
+} catch (const std::exception& e) {
+    fmt::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <optional>
+#include <string>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+#include <fmt/printf.h>
+#include <cxxopts.hpp>
+
+#include <chip8/chip8.h>
+#include <chip8/native.h>
+#include <chip8/scheduler.h>
+
+// defined by the source chip8_aot generated, see chip8_add_native_rom()
+extern const NativeProgram translated_rom;
+
+namespace
+{
+
+// runs one frame, the fault ends the run
+std::optional<std::string> run_frame(Scheduler& scheduler, std::uint64_t cycles)
+{
+    try {
+        scheduler.run_cycles(cycles);
+    } catch (const Exception& e) {
+        return fmt::format("{}: {}", e.what(), e.message());
+    }
+    return std::nullopt;
+}
+
+}
+
+// the runner every translated ROM is linked with: runs it without display, optionally
+// next to the interpreter to check that both agree on the state after every frame
+int main(int argc, char* argv[])
+try {
+    const auto& program = translated_rom;
+    cxxopts::Options options{argv[0], fmt::format("Runs {} translated to native code", program.name)};
+    options.add_options()
+        ("f,frames", "Number of 60 Hz frames to run", cxxopts::value<std::uint64_t>()->default_value("600"))
+        ("i,ipf", "Instructions per frame", cxxopts::value<std::uint64_t>()->default_value("10"))
+        ("s,seed", "Seed for the random number generator", cxxopts::value<std::uint32_t>()->default_value("0"))
+        ("e,engine", "Execution engine (native, interpreter, block), to compare their speed", cxxopts::value<std::string>()->default_value("native"))
+        ("check", "Run the interpreter alongside and compare the state hashes after every frame")
+        ("hashes", "Write \"<frame> <framebuffer hash> <state hash>\" after every frame to a file, as chip8_headless does", cxxopts::value<std::string>())
+        ("h,help", "Print help")
+    ;
+
+    auto opts = options.parse(argc, argv);
+    if (opts.count("help")) {
+        fmt::print("{}\n", options.help({""}));
+        return 0;
+    }
+
+    const auto frames = opts["frames"].as<std::uint64_t>();
+    const auto ipf = std::max<std::uint64_t>(opts["ipf"].as<std::uint64_t>(), 1);
+    const auto seed = opts["seed"].as<std::uint32_t>();
+    const auto rate = static_cast<unsigned>(ipf * Scheduler::timer_rate);
+
+    Chip8Cpu chip8;
+    chip8.seed(seed);
+    program.load(chip8);
+    const auto engine = opts["engine"].as<std::string>();
+    if (engine == "interpreter") {
+        chip8.set_engine(Chip8Cpu::Engine::interpreter);
+    } else if (engine == "block") {
+        chip8.set_engine(Chip8Cpu::Engine::block);
+    } else if (engine != "native") {
+        fmt::fprintf(stderr, "Error: unknown engine \"%s\"\n", engine);
+        return 1;
+    }
+    Scheduler scheduler{chip8, rate};
+
+    // the reference: the same ROM on the interpreter
+    std::optional<Chip8Cpu> reference;
+    std::optional<Scheduler> reference_scheduler;
+    if (opts.count("check")) {
+        reference.emplace();
+        reference->seed(seed);
+        reference->set_quirks(program.quirks);
+        reference->load_rom(program.rom);
+        reference_scheduler.emplace(*reference, rate);
+    }
+
+    std::ofstream hashes;
+    if (opts.count("hashes")) {
+        hashes.open(opts["hashes"].as<std::string>());
+        if (!hashes) {
+            throw IOException("Can't write file {}", opts["hashes"].as<std::string>());
+        }
+    }
+
+    int status = 0;
+    std::uint64_t matched = 0;
+    std::chrono::duration<double> elapsed{};
+    for (std::uint64_t frame = 1; frame <= frames; frame++) {
+        const auto start = std::chrono::steady_clock::now();
+        const auto fault = run_frame(scheduler, ipf);
+        elapsed += std::chrono::steady_clock::now() - start;
+        if (hashes.is_open()) {
+            fmt::print(hashes, "{} {:016x} {:016x}\n", frame, chip8.framebuffer_hash(), chip8.state_hash());
+        }
+
+        if (reference) {
+            const auto expected = run_frame(*reference_scheduler, ipf);
+            if (chip8.state_hash() != reference->state_hash() || fault.has_value() != expected.has_value()) {
+                fmt::print("mismatch after frame {}: pc {:#06x} instead of {:#06x}, state {:016x} instead of {:016x}\n",
+                           frame, chip8.program_counter(), reference->program_counter(), chip8.state_hash(), reference->state_hash());
+                status = 3;
+                break;
+            }
+            matched++;
+        }
+        if (fault) {
+            fmt::print("fault: {}\n", *fault);
+            status = 2;
+            break;
+        }
+    }
+
+    const auto cycles = scheduler.cycles();
+    fmt::print("rom: {}\n", program.name);
+    fmt::print("pc: {:#06x}\n", chip8.program_counter());
+    fmt::print("framebuffer: {:016x}\n", chip8.framebuffer_hash());
+    fmt::print("state: {:016x}\n", chip8.state_hash());
+    fmt::print("cycles: {}\n", cycles);
+    fmt::print("time: {:.3f} ms\n", elapsed.count() * 1000);
+    fmt::print("speed: {:.2f} MIPS\n", elapsed.count() > 0 ? cycles / elapsed.count() / 1e6 : 0.0);
+    if (reference) {
+        fmt::print("check: {} frames match the interpreter\n", matched);
+    }
+
+    return status;
+} catch (const Exception& e) {
+    fmt::fprintf(stderr, "Error: %s: %s\n", e.what(), std::string{e.message()});
+    return 1;
+} catch (const std::exception& e) {
+    fmt::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
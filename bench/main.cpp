@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <cxxopts.hpp>
+
+#include <chip8/audio.h>
+#include <chip8/batch.h>
+#include <chip8/chip8.h>
+#include <chip8/code_map.h>
+#include <chip8/rom_library.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+struct Result
+{
+    std::string name;
+    std::uint64_t ops;
+    double seconds;
+
+    double ns_per_op() const
+    {
+        return ops ? seconds * 1e9 / ops : 0.0;
+    }
+
+    double ops_per_second() const
+    {
+        return seconds > 0 ? ops / seconds : 0.0;
+    }
+};
+
+// a benchmark body performs some work and returns how many operations it did
+using Body = std::function<std::uint64_t()>;
+
+class Suite
+{
+public:
+    Suite(std::string filter, std::chrono::milliseconds min_time)
+        : m_filter(std::move(filter)), m_min_time(min_time) {}
+
+    void add(const std::string& name, const Body& body)
+    {
+        if (name.find(m_filter) == std::string::npos) {
+            return;
+        }
+
+        body(); // warm-up, fills the caches
+
+        std::uint64_t ops = 0;
+        const auto start = bench_clock::now();
+        auto elapsed = bench_clock::duration::zero();
+        do {
+            ops += body();
+            elapsed = bench_clock::now() - start;
+        } while (elapsed < m_min_time);
+
+        m_results.push_back({name, ops, std::chrono::duration<double>(elapsed).count()});
+        fmt::fprintf(stderr, "%-40s %12.2f ns/op %16.0f op/s\n", name, m_results.back().ns_per_op(), m_results.back().ops_per_second());
+    }
+
+    const std::vector<Result>& results() const noexcept
+    {
+        return m_results;
+    }
+
+private:
+    std::string m_filter;
+    std::chrono::milliseconds m_min_time;
+    std::vector<Result> m_results;
+};
+
+// assembles big-endian instruction words into a ROM image
+std::vector<std::uint8_t> assemble(const std::vector<std::uint16_t>& words)
+{
+    std::vector<std::uint8_t> rom;
+    for (auto w : words) {
+        rom.push_back(static_cast<std::uint8_t>(w >> 8));
+        rom.push_back(static_cast<std::uint8_t>(w & 0xFF));
+    }
+    return rom;
+}
+
+constexpr int body_length = 64;
+
+// prologue, then body_length copies of the body instructions and a jump back to the first copy
+std::vector<std::uint8_t> loop_rom(const std::vector<std::uint16_t>& prologue, const std::vector<std::uint16_t>& body, const std::vector<std::uint16_t>& epilogue = {})
+{
+    std::vector<std::uint16_t> words = prologue;
+    const auto loop = static_cast<std::uint16_t>(0x200 + 2 * words.size());
+    for (int i = 0; i < body_length; i++) {
+        words.insert(words.end(), body.begin(), body.end());
+    }
+    words.push_back(0x1000 | loop);
+    words.insert(words.end(), epilogue.begin(), epilogue.end());
+    return assemble(words);
+}
+
+struct Program
+{
+    const char* name;
+    std::vector<std::uint8_t> rom;
+};
+
+// one loop per opcode group of the instruction table, data lives at 0x400 and up
+std::vector<Program> opcode_programs()
+{
+    const auto sub = static_cast<std::uint16_t>(0x200 + 2 * (body_length + 1));
+    return {
+        {"0_cls", loop_rom({}, {0x00E0})},
+        {"1_jp", assemble({0x1200})},
+        {"2_call_ret", loop_rom({}, {static_cast<std::uint16_t>(0x2000 | sub)}, {0x00EE})},
+        {"3_se_imm", loop_rom({0x6001}, {0x3000})},
+        {"4_sne_imm", loop_rom({0x6001}, {0x4001})},
+        {"5_se_reg", loop_rom({0x6001, 0x6102}, {0x5010})},
+        {"6_ld_imm", loop_rom({}, {0x6A12})},
+        {"7_add_imm", loop_rom({}, {0x7A03})},
+        {"8_alu", loop_rom({0x6107}, {0x8010, 0x8011, 0x8012, 0x8013, 0x8014, 0x8015, 0x8016, 0x8017, 0x801E})},
+        {"9_sne_reg", loop_rom({0x6001, 0x6101}, {0x9010})},
+        {"A_ld_i", loop_rom({}, {0xA400})},
+        {"B_jp_v0", loop_rom({0x6000}, {0xB000 | 0x202})},
+        {"C_rnd", loop_rom({}, {0xC0FF})},
+        {"D_drw", loop_rom({0x6000, 0x6100, 0xA000}, {0xD01F})},
+        {"E_skp", loop_rom({0x6005}, {0xE09E})},
+        {"F_timers", loop_rom({0x6010}, {0xF015, 0xF018, 0xF007})},
+        {"F_index", loop_rom({0x6005}, {0xF01E, 0xF029})},
+        {"F_bcd", loop_rom({0x60FE, 0xA400}, {0xF033})},
+        {"F_store_load", loop_rom({0xA400}, {0xFF55, 0xFF65})},
+    };
+}
+
+// a game-like mix: moving sprites with collision checks, a BCD score and key polling
+std::vector<std::uint8_t> synthetic_game()
+{
+    return assemble({
+        0x6A00, // 200: score = 0
+        0x00E0, // 202: frame: clear
+        0xC03F, // 204: x = rnd & 63
+        0xC11F, // 206: y = rnd & 31
+        0xC20F, // 208: glyph = rnd & 15
+        0xF229, // 20A: I = font(glyph)
+        0xD015, // 20C: draw
+        0x3F00, // 20E: skip unless collision
+        0x7A01, // 210: score++
+        0xA400, // 212: I = 0x400
+        0xFA33, // 214: bcd(score)
+        0xF265, // 216: load digits into V0..V2
+        0x6300, // 218: key = 0
+        0xE39E, // 21A: skip if pressed
+        0x1220, // 21C: -> continue
+        0x7A10, // 21E: bonus
+        0x6400, // 220: i = 0
+        0x7401, // 222: loop: i++
+        0x8540, // 224: t = i
+        0x8556, // 226: t >>= 1
+        0x3410, // 228: skip when i == 16
+        0x1222, // 22A: -> loop
+        0x1202, // 22C: -> frame
+    });
+}
+
+std::uint64_t run_engine(const std::vector<std::uint8_t>& rom, Chip8Cpu::Engine engine, std::uint64_t cycles)
+{
+    static Chip8Cpu chip8;
+    static const std::vector<std::uint8_t>* loaded = nullptr;
+    static Chip8Cpu::Engine loaded_engine = Chip8Cpu::Engine::interpreter;
+
+    // keep the machine and its caches across iterations of the same benchmark
+    if (loaded != &rom || loaded_engine != engine) {
+        chip8 = Chip8Cpu{};
+        chip8.seed(1);
+        chip8.set_engine(engine);
+        chip8.load_rom(rom);
+        loaded = &rom;
+        loaded_engine = engine;
+    }
+    return chip8.run(cycles);
+}
+
+void add_engine_benchmarks(Suite& suite, const std::string& name, const std::vector<std::uint8_t>& rom, std::uint64_t cycles)
+{
+    suite.add(name + "/interpreter", [&rom, cycles] {
+        return run_engine(rom, Chip8Cpu::Engine::interpreter, cycles);
+    });
+    suite.add(name + "/block", [&rom, cycles] {
+        return run_engine(rom, Chip8Cpu::Engine::block, cycles);
+    });
+}
+
+// a 256 bit vector of 8 bit registers
+constexpr std::size_t batch_lanes = 32;
+
+// the same ROM on batch_lanes machines with their own seeds, one after the other or in a Chip8Batch
+std::uint64_t run_machines(const std::vector<std::uint8_t>& rom, bool batched, std::uint64_t cycles)
+{
+    static std::vector<Chip8Cpu> machines;
+    static Chip8Batch<batch_lanes> batch;
+    static const std::vector<std::uint8_t>* loaded = nullptr;
+    static bool loaded_batched = false;
+
+    if (loaded != &rom || loaded_batched != batched) {
+        machines = std::vector<Chip8Cpu>(batch_lanes);
+        batch = Chip8Batch<batch_lanes>{};
+        batch.load_rom(rom);
+        for (std::size_t i = 0; i < batch_lanes; i++) {
+            machines[i].seed(static_cast<std::uint32_t>(i + 1));
+            machines[i].load_rom(rom);
+            batch.seed(i, static_cast<std::uint32_t>(i + 1));
+        }
+        loaded = &rom;
+        loaded_batched = batched;
+    }
+
+    std::uint64_t done = 0;
+    if (batched) {
+        for (const auto& result : batch.run(cycles)) {
+            done += result.cycles;
+        }
+    } else {
+        for (auto& machine : machines) {
+            done += machine.try_run(cycles).cycles;
+        }
+    }
+    return done;
+}
+
+void add_batch_benchmarks(Suite& suite, const std::string& name, const std::vector<std::uint8_t>& rom, std::uint64_t cycles)
+{
+    suite.add(name + "/separate", [&rom, cycles] {
+        return run_machines(rom, false, cycles);
+    });
+    suite.add(name + "/batch", [&rom, cycles] {
+        return run_machines(rom, true, cycles);
+    });
+}
+
+std::string json_escape(const std::string& s)
+{
+    std::string out;
+    for (auto c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out;
+}
+
+// one benchmark per line so that baselines can be read back without a JSON library
+std::string to_json(const std::vector<Result>& results)
+{
+    std::string out = "{\n  \"benchmarks\": [\n";
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const auto& r = results[i];
+        out += fmt::format("    {{\"name\": \"{}\", \"ops\": {}, \"seconds\": {:.6f}, \"ns_per_op\": {:.3f}, \"ops_per_second\": {:.1f}}}{}\n",
+            json_escape(r.name), r.ops, r.seconds, r.ns_per_op(), r.ops_per_second(), i + 1 < results.size() ? "," : "");
+    }
+    out += "  ]\n}\n";
+    return out;
+}
+
+std::map<std::string, double> read_baseline(const fs::path& path)
+{
+    std::ifstream ifs(path);
+    if (!ifs) {
+        throw FileNotFoundException(path.u8string());
+    }
+
+    std::map<std::string, double> baseline;
+    std::string line;
+    while (std::getline(ifs, line)) {
+        const auto name_pos = line.find("\"name\": \"");
+        const auto ops_pos = line.find("\"ops_per_second\": ");
+        if (name_pos == std::string::npos || ops_pos == std::string::npos) {
+            continue;
+        }
+        const auto name_start = name_pos + 9;
+        const auto name_end = line.find("\", ", name_start);
+        baseline[line.substr(name_start, name_end - name_start)] = std::stod(line.substr(ops_pos + 18));
+    }
+    return baseline;
+}
+
+}
+
+int main(int argc, char* argv[])
+try {
+    cxxopts::Options options{argv[0], "Chip-8 core benchmarks"};
+    options.add_options()
+        ("f,filter", "Only run benchmarks whose name contains this string", cxxopts::value<std::string>()->default_value(""))
+        ("t,min-time", "Minimum run time per benchmark in ms", cxxopts::value<unsigned>()->default_value("200"))
+        ("r,rom", "Additional ROM, ROM directory or archive to run as macro benchmarks", cxxopts::value<std::vector<std::string>>())
+        ("c,cycles", "Instructions per iteration of the macro benchmarks", cxxopts::value<std::uint64_t>()->default_value("100000"))
+        ("o,output", "Write JSON results to this file instead of stdout", cxxopts::value<std::string>())
+        ("b,baseline", "Compare against the JSON results of an earlier run", cxxopts::value<std::string>())
+        ("tolerance", "Allowed slowdown against the baseline in percent", cxxopts::value<double>()->default_value("10"))
+        ("h,help", "Print help")
+    ;
+
+    auto opts = options.parse(argc, argv);
+    if (opts.count("help")) {
+        fmt::print("{}\n", options.help({""}));
+        return 0;
+    }
+
+    Suite suite{opts["filter"].as<std::string>(), std::chrono::milliseconds{opts["min-time"].as<unsigned>()}};
+    const auto macro_cycles = opts["cycles"].as<std::uint64_t>();
+    constexpr std::uint64_t micro_cycles = 10000;
+
+    // micro: one loop per opcode group, through both engines
+    const auto programs = opcode_programs();
+    for (const auto& p : programs) {
+        add_engine_benchmarks(suite, std::string{"opcode/"} + p.name, p.rom, micro_cycles);
+    }
+
+    // micro: the draw path with sprites crossing the screen edges
+    const auto clipped = loop_rom({0x603C, 0x611C, 0xA000}, {0xD01F});
+    add_engine_benchmarks(suite, "drw/clipped", clipped, micro_cycles);
+
+    // micro: the per-instruction step() entry point
+    const auto ld_imm = loop_rom({}, {0x6A12});
+    suite.add("step/dispatch", [&ld_imm] {
+        static Chip8Cpu chip8;
+        static bool loaded = false;
+        if (!loaded) {
+            chip8.load_rom(ld_imm);
+            loaded = true;
+        }
+        for (std::uint64_t i = 0; i < micro_cycles; i++) {
+            chip8.step();
+        }
+        return micro_cycles;
+    });
+
+    // micro: pre-generating random bytes in bulk, per byte
+    suite.add("rng/fill", [] {
+        static utils::Random rng{1};
+        static std::uint8_t bytes[4096];
+        rng.fill(bytes, sizeof(bytes));
+        return std::uint64_t{sizeof(bytes)};
+    });
+
+    // micro: synthesizing one timer tick of buzzer sound and draining it, per sample
+    suite.add("audio/tick", [] {
+        static Chip8Cpu chip8;
+        static AudioStream audio;
+        static std::int16_t samples[AudioStream::default_sample_rate / 60 + 1];
+        static bool loaded = false;
+        if (!loaded) {
+            // LD VA, 0xFF; LD ST, VA
+            const std::vector<std::uint8_t> beep{0x6A, 0xFF, 0xFA, 0x18};
+            chip8.load_rom(beep);
+            chip8.run_until(2, 0);
+            loaded = true;
+        }
+        audio.tick(chip8);
+        return std::uint64_t{audio.read(samples, std::size(samples))};
+    });
+
+    // micro: hashing the whole machine, e.g. to deduplicate states in a search
+    suite.add("hash/state", [&ld_imm] {
+        static Chip8Cpu chip8;
+        static bool loaded = false;
+        if (!loaded) {
+            chip8.load_rom(ld_imm);
+            loaded = true;
+        }
+        return std::uint64_t{chip8.state_hash() != 0};
+    });
+
+    // micro: loading a ROM from memory and from disk
+    const auto game = synthetic_game();
+    suite.add("load_rom/memory", [&game] {
+        static Chip8Cpu chip8;
+        chip8.load_rom(game);
+        return std::uint64_t{1};
+    });
+
+    // micro: static analysis of a loaded ROM, the price of predecoding it
+    suite.add("analyze/code_map", [&game] {
+        static Chip8Cpu chip8;
+        static bool loaded = false;
+        if (!loaded) {
+            chip8.load_rom(game);
+            loaded = true;
+        }
+        const CodeMap map{chip8};
+        return std::uint64_t{!map.blocks().empty()};
+    });
+
+    const auto rom_path = fs::temp_directory_path() / "chip8_bench.ch8";
+    {
+        std::ofstream ofs(rom_path, std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(game.data()), static_cast<std::streamsize>(game.size()));
+    }
+    suite.add("load_rom/file", [&rom_path] {
+        static Chip8Cpu chip8;
+        chip8.load_rom(rom_path);
+        return std::uint64_t{1};
+    });
+
+    // micro: loading from a memory mapped library, looked up by content hash like a movie's ROM
+    {
+        const RomLibrary library{rom_path};
+        const auto game_hash = content_hash(game);
+        suite.add("load_rom/library", [&library, game_hash] {
+            static Chip8Cpu chip8;
+            chip8.load_rom(library.find(game_hash)->data);
+            return std::uint64_t{1};
+        });
+    }
+
+    // micro: what Window::render does per frame, expanding the framebuffer into RGBA pixels
+    suite.add("render/texture_fill", [&game] {
+        static Chip8Cpu chip8;
+        static std::uint32_t pixels[Chip8Cpu::hires_height][Chip8Cpu::hires_width];
+        static constexpr std::uint32_t palette[4] = {0u, 0xFFFFFFFFu, 0xAAAAAAFFu, 0x555555FFu};
+        static bool loaded = false;
+        if (!loaded) {
+            chip8.seed(1);
+            chip8.load_rom(game);
+            chip8.run(1000);
+            loaded = true;
+        }
+        for (int y = 0; y < chip8.height(); y++) {
+            chip8.unpack_row(y, pixels[y], palette);
+        }
+        return std::uint64_t{1};
+    });
+
+    // macro: whole programs for a fixed number of instructions
+    add_engine_benchmarks(suite, "rom/synthetic_game", game, macro_cycles);
+
+    // macro: batch_lanes machines, per instruction: ALU code they run in lockstep, and a game
+    // whose random sprites make them take different branches
+    const auto alu = std::find_if(programs.begin(), programs.end(), [](const Program& p) {
+        return std::string{p.name} == "8_alu";
+    });
+    add_batch_benchmarks(suite, "batch/8_alu", alu->rom, macro_cycles);
+    add_batch_benchmarks(suite, "batch/synthetic_game", game, macro_cycles);
+
+    std::vector<std::vector<std::uint8_t>> roms;
+    std::vector<std::string> rom_names;
+    if (opts.count("rom")) {
+        for (const auto& path : opts["rom"].as<std::vector<std::string>>()) {
+            const RomLibrary roms_at_path{path};
+            for (const auto& rom : roms_at_path.roms()) {
+                roms.emplace_back(rom.data.begin(), rom.data.end());
+                rom_names.push_back("rom/" + rom.name);
+            }
+        }
+    }
+    for (std::size_t i = 0; i < roms.size(); i++) {
+        add_engine_benchmarks(suite, rom_names[i], roms[i], macro_cycles);
+    }
+
+    fs::remove(rom_path);
+
+    const auto json = to_json(suite.results());
+    if (opts.count("output")) {
+        std::ofstream ofs(opts["output"].as<std::string>());
+        ofs << json;
+    } else {
+        fmt::print("{}", json);
+    }
+
+    if (!opts.count("baseline")) {
+        return 0;
+    }
+
+    const auto baseline = read_baseline(opts["baseline"].as<std::string>());
+    const auto tolerance = opts["tolerance"].as<double>() / 100;
+    int regressions = 0;
+    for (const auto& r : suite.results()) {
+        const auto it = baseline.find(r.name);
+        if (it == baseline.end() || it->second <= 0) {
+            continue;
+        }
+        const auto ratio = r.ops_per_second() / it->second;
+        if (ratio < 1 - tolerance) {
+            fmt::fprintf(stderr, "REGRESSION %s: %.1f%% of baseline\n", r.name, ratio * 100);
+            ++regressions;
+        }
+    }
+    return regressions ? 1 : 0;
+} catch (const Exception& e) {
+    fmt::fprintf(stderr, "Error: %s: %s\n", e.what(), std::string{e.message()});
+    return 1;
+} catch (const std::exception& e) {
+    fmt::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
@@ -0,0 +1,68 @@
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <cxxopts.hpp>
+
+#include <chip8/chip8.h>
+#include <chip8/code_map.h>
+
+int main(int argc, char* argv[])
+try {
+    cxxopts::Options options{argv[0], "Disassembles a ROM along its control flow"};
+    options.add_options()
+        ("p,path", "Path to the ROM file", cxxopts::value<std::string>())
+        ("q,quirks", fmt::format("Interpreter quirks ({})", Chip8Cpu::quirks_names()), cxxopts::value<std::string>()->default_value("chip8"))
+        ("b,blocks", "List the basic blocks and their successors instead")
+        ("c,calls", "List the call graph instead")
+        ("h,help", "Print help")
+    ;
+
+    auto opts = options.parse(argc, argv);
+    if (opts.count("help") || !opts.count("path")) {
+        fmt::print("{}\n", options.help({""}));
+        return opts.count("help") ? 0 : 1;
+    }
+
+    Chip8Cpu chip8;
+    const auto quirks_name = opts["quirks"].as<std::string>();
+    const auto quirks = Chip8Cpu::parse_quirks(quirks_name);
+    if (!quirks) {
+        fmt::fprintf(stderr, "Error: unknown quirks \"%s\"\n", quirks_name);
+        return 1;
+    }
+    chip8.set_quirks(*quirks);
+    chip8.load_rom(opts["path"].as<std::string>());
+
+    const CodeMap map{chip8};
+    if (opts.count("blocks")) {
+        for (const auto& block : map.blocks()) {
+            std::string successors;
+            for (const auto s : block.successors) {
+                successors += fmt::format(" {:#06x}", s);
+            }
+            if (block.indirect) {
+                successors += " ?";
+            }
+            const auto call = block.callee ? fmt::format(" call {:#06x}", *block.callee) : std::string{};
+            fmt::print("{:#06x}-{:#06x}{} ->{}\n", block.start, block.end, call, successors);
+        }
+    } else if (opts.count("calls")) {
+        for (const auto& edge : map.call_edges()) {
+            fmt::print("{:#06x} -> {:#06x}\n", edge.caller, edge.callee);
+        }
+    } else {
+        map.write_listing(std::cout);
+    }
+
+    return 0;
+} catch (const Exception& e) {
+    fmt::fprintf(stderr, "Error: %s: %s\n", e.what(), std::string{e.message()});
+    return 1;
+} catch (const std::exception& e) {
+    fmt::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <chip8/chip8.h>
+
+#ifndef CHIP8_LIBFUZZER
+#include <fmt/format.h>
+#include <fmt/printf.h>
+#include <cxxopts.hpp>
+#endif
+
+namespace
+{
+
+constexpr std::uint16_t rom_start = 0x200;
+
+// instructions per input: enough to get past setup code into the main loop,
+// few enough for thousands of inputs per second
+constexpr std::uint64_t max_cycles = 10000;
+
+// the timers tick as at the default rate, so delay loops can finish
+constexpr std::uint64_t cycles_per_tick = 700 / 60;
+
+// the first input byte configures the run, the rest is the ROM:
+// bits 0-1 select the quirks profile, bit 2 compares the block engine against
+// the interpreter, bit 3 holds the key in bits 4-7 down for the whole run
+constexpr std::uint8_t compare_engines = 1 << 2;
+constexpr std::uint8_t hold_key = 1 << 3;
+
+// a machine per profile and engine, set back to its freshly constructed state for every input
+struct Target
+{
+    Chip8Cpu chip8;
+    Chip8Cpu::State initial;
+};
+
+Target& target(Chip8Cpu::Quirks quirks, Chip8Cpu::Engine engine)
+{
+    static std::unique_ptr<Target> targets[4][2];
+    auto& t = targets[static_cast<int>(quirks)][static_cast<int>(engine)];
+    if (!t) {
+        t = std::make_unique<Target>();
+        t->chip8.set_quirks(quirks);
+        t->chip8.set_engine(engine);
+        t->initial = t->chip8.snapshot();
+    }
+    return *t;
+}
+
+Chip8Cpu::RunResult run(Target& t, utils::span<const std::uint8_t> rom, int key)
+{
+    auto& chip8 = t.chip8;
+    chip8.reset(t.initial);
+    chip8.load_rom(rom);
+    if (key >= 0) {
+        chip8.keys[key] = 1;
+    }
+
+    Chip8Cpu::RunResult total{0, Chip8Cpu::Fault::none, Chip8Cpu::StopReason::cycles};
+    while (total.cycles < max_cycles) {
+        const auto result = chip8.try_run_until(std::min(cycles_per_tick, max_cycles - total.cycles),
+                                                Chip8Cpu::stop_on_key_wait | Chip8Cpu::stop_on_exit);
+        total.cycles += result.cycles;
+        total.fault = result.fault;
+        total.reason = result.reason;
+        if (result.reason != Chip8Cpu::StopReason::cycles) {
+            break;
+        }
+        chip8.count_down();
+    }
+    return total;
+}
+
+}
+
+// faults are an ordinary outcome for random ROMs; what counts as a crash is whatever the
+// sanitizers catch, plus both engines disagreeing about the same input
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t* data, std::size_t size)
+{
+    if (size < 1) {
+        return 0;
+    }
+
+    const auto config = data[0];
+    const auto quirks = static_cast<Chip8Cpu::Quirks>(config & 3);
+    const int key = config & hold_key ? config >> 4 : -1;
+
+    auto& interpreter = target(quirks, Chip8Cpu::Engine::interpreter);
+    const auto rom_size = std::min<std::size_t>(size - 1, interpreter.chip8.memory_limit() - rom_start);
+    const utils::span<const std::uint8_t> rom{data + 1, rom_size};
+    const auto expected = run(interpreter, rom, key);
+
+    if (config & compare_engines) {
+        auto& block = target(quirks, Chip8Cpu::Engine::block);
+        const auto actual = run(block, rom, key);
+        if (actual.cycles != expected.cycles || actual.reason != expected.reason || actual.fault != expected.fault
+            || block.chip8.state_hash() != interpreter.chip8.state_hash()) {
+            std::fprintf(stderr, "engines disagree: interpreter ran %llu cycles to pc %#06x, block engine %llu to %#06x\n",
+                         static_cast<unsigned long long>(expected.cycles), interpreter.chip8.program_counter(),
+                         static_cast<unsigned long long>(actual.cycles), block.chip8.program_counter());
+            std::abort();
+        }
+    }
+    return 0;
+}
+
+#ifndef CHIP8_LIBFUZZER
+
+namespace
+{
+
+namespace fs = std::filesystem;
+
+std::vector<std::uint8_t> read_file(const fs::path& path)
+{
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        throw IOException("Can't read file " + path.u8string());
+    }
+    return {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+}
+
+}
+
+// without libFuzzer: replays corpus files, e.g. crashes found elsewhere, and throws random inputs at the target
+int main(int argc, char* argv[])
+try {
+    cxxopts::Options options{argv[0], "Runs inputs through the fuzz target without libFuzzer"};
+    options.add_options()
+        ("i,input", "Input file or directory of inputs to run once each", cxxopts::value<std::vector<std::string>>())
+        ("n,runs", "Number of random inputs to run", cxxopts::value<std::uint64_t>()->default_value("0"))
+        ("s,seed", "Seed for the random inputs", cxxopts::value<std::uint32_t>()->default_value("1"))
+        ("max-len", "Maximum length of a random input", cxxopts::value<std::size_t>()->default_value("512"))
+        ("h,help", "Print help")
+    ;
+
+    auto opts = options.parse(argc, argv);
+    if (opts.count("help") || (!opts.count("input") && !opts["runs"].as<std::uint64_t>())) {
+        fmt::print("{}\n", options.help({""}));
+        return opts.count("help") ? 0 : 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    std::uint64_t execs = 0;
+
+    if (opts.count("input")) {
+        for (const auto& input : opts["input"].as<std::vector<std::string>>()) {
+            std::vector<fs::path> files;
+            if (fs::is_directory(input)) {
+                for (const auto& entry : fs::recursive_directory_iterator(input)) {
+                    if (entry.is_regular_file()) {
+                        files.push_back(entry.path());
+                    }
+                }
+                std::sort(files.begin(), files.end());
+            } else {
+                files.emplace_back(input);
+            }
+
+            for (const auto& file : files) {
+                const auto data = read_file(file);
+                LLVMFuzzerTestOneInput(data.data(), data.size());
+                execs++;
+            }
+        }
+    }
+
+    utils::Random rng{opts["seed"].as<std::uint32_t>()};
+    const auto max_len = std::max<std::size_t>(opts["max-len"].as<std::size_t>(), 1);
+    std::vector<std::uint8_t> data(max_len);
+    for (std::uint64_t i = opts["runs"].as<std::uint64_t>(); i > 0; i--) {
+        const auto size = 1 + rng() % max_len;
+        rng.fill(data.data(), size);
+        LLVMFuzzerTestOneInput(data.data(), size);
+        execs++;
+    }
+
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print("execs: {}\n", execs);
+    fmt::print("time: {:.3f} ms\n", elapsed.count() * 1000);
+    fmt::print("exec/s: {:.0f}\n", elapsed.count() > 0 ? execs / elapsed.count() : 0.0);
+    return 0;
+} catch (const Exception& e) {
+    fmt::fprintf(stderr, "Error: %s: %s\n", e.what(), std::string{e.message()});
+    return 1;
+} catch (const std::exception& e) {
+    fmt::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+}
+
+#endif
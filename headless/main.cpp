@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+#include <fmt/printf.h>
+#include <cxxopts.hpp>
+
+#include <chip8/audio.h>
+#include <chip8/chip8.h>
+#include <chip8/code_map.h>
+#include <chip8/movie.h>
+#include <chip8/profiler.h>
+#include <chip8/rom_library.h>
+#include <chip8/scheduler.h>
+
+namespace fs = std::filesystem;
+
+namespace
+{
+
+// one event per line: "<cycle> <key 0-F> <down|up>", lines starting with # are ignored
+std::vector<KeyEvent> load_key_script(const fs::path& path)
+{
+    std::ifstream ifs(path);
+    if (!ifs) {
+        throw FileNotFoundException(path.u8string());
+    }
+
+    std::vector<KeyEvent> events;
+    std::string line;
+    for (int lineno = 1; std::getline(ifs, line); lineno++) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        unsigned long long cycle;
+        unsigned key;
+        char state[8];
+        if (std::sscanf(line.c_str(), "%llu %x %7s", &cycle, &key, state) != 3 || key >= Chip8Cpu::keys_size) {
+            throw IOException("Malformed key event in {} on line {}", path.u8string(), lineno);
+        }
+
+        const std::string s{state};
+        if (s != "down" && s != "up") {
+            throw IOException("Unknown key state \"{}\" in {} on line {}", s, path.u8string(), lineno);
+        }
+        events.push_back({cycle, static_cast<std::uint8_t>(key), s == "down"});
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](const KeyEvent& a, const KeyEvent& b) {
+        return a.cycle < b.cycle;
+    });
+    return events;
+}
+
+void dump_state(const Chip8Cpu& chip8)
+{
+    fmt::print("pc: {:#06x}\n", chip8.program_counter());
+    fmt::print("I: {:#06x}\n", chip8.address_register());
+    fmt::print("sp: {}\n", chip8.stack_pointer());
+
+    std::string regs;
+    for (int i = 0; i < Chip8Cpu::reg_size; i++) {
+        regs += fmt::format(" {:02X}", chip8.registers()[i]);
+    }
+    fmt::print("V:{}\n", regs);
+    fmt::print("delay_timer: {}\n", chip8.delay_timer_value());
+    fmt::print("sound_timer: {}\n", chip8.sound_timer_value());
+    fmt::print("framebuffer: {:016x}\n", chip8.framebuffer_hash());
+    fmt::print("state: {:016x}\n", chip8.state_hash());
+}
+
+}
+
+int main(int argc, char* argv[])
+try {
+    cxxopts::Options options{argv[0], "Runs a ROM without display as fast as possible"};
+    options.add_options()
+        ("p,path", "Path to the ROM file, or its name in the library", cxxopts::value<std::string>())
+        ("l,library", "ROM directory or archive to take the ROM from, replays without --path find theirs by hash", cxxopts::value<std::string>())
+        ("c,cycles", "Number of instructions to run", cxxopts::value<std::uint64_t>())
+        ("f,frames", "Number of 60 Hz frames to run", cxxopts::value<std::uint64_t>())
+        ("i,ipf", "Instructions per frame", cxxopts::value<std::uint64_t>()->default_value("10"))
+        ("k,keys", "Key script, one \"<cycle> <key> <down|up>\" per line", cxxopts::value<std::string>())
+        ("e,engine", "Execution engine (interpreter, block)", cxxopts::value<std::string>()->default_value("interpreter"))
+        ("predecode", "Decode the blocks static analysis finds at load time instead of on first use")
+        ("q,quirks", fmt::format("Interpreter quirks ({})", Chip8Cpu::quirks_names()), cxxopts::value<std::string>()->default_value("chip8"))
+        ("s,seed", "Seed for the random number generator", cxxopts::value<std::uint32_t>())
+        ("record", "Record the seed and key events to a movie file", cxxopts::value<std::string>())
+        ("replay", "Replay a movie file, runs until its end unless --cycles or --frames is given", cxxopts::value<std::string>())
+        ("hashes", "Write \"<frame> <framebuffer hash> <state hash>\" after every frame to a file", cxxopts::value<std::string>())
+        ("wav", "Write the sound to a 16 bit mono WAV file", cxxopts::value<std::string>())
+        ("sample-rate", "Sample rate of the WAV file", cxxopts::value<unsigned>()->default_value("44100"))
+#ifdef CHIP8_PROFILING
+        ("profile", "Write a flat profile to PREFIX.txt and folded call stacks to PREFIX.folded", cxxopts::value<std::string>())
+#endif
+        ("h,help", "Print help")
+    ;
+
+    auto opts = options.parse(argc, argv);
+    const bool replaying = opts.count("replay") > 0;
+    const auto lengths = opts.count("cycles") + opts.count("frames");
+    const bool valid_length = lengths == 1 || (replaying && lengths == 0);
+    const bool has_rom = opts.count("path") || (replaying && opts.count("library"));
+    if (opts.count("help") || !has_rom || !valid_length || (replaying && (opts.count("keys") || opts.count("record")))) {
+        fmt::print("{}\n", options.help({""}));
+        return opts.count("help") ? 0 : 1;
+    }
+
+    const fs::path path = opts.count("path") ? opts["path"].as<std::string>() : "";
+    auto ipf = std::max<std::uint64_t>(opts["ipf"].as<std::uint64_t>(), 1);
+    // the scheduler and movies take the rate, ipf * timer_rate, as an unsigned
+    constexpr std::uint64_t max_ipf = std::numeric_limits<unsigned>::max() / Scheduler::timer_rate;
+    if (ipf > max_ipf) {
+        fmt::fprintf(stderr, "Error: --ipf must be at most %u\n", max_ipf);
+        return 1;
+    }
+    auto rate = static_cast<unsigned>(ipf * Scheduler::timer_rate);
+    std::uint32_t seed = opts.count("seed") ? opts["seed"].as<std::uint32_t>() : std::random_device{}();
+
+    const auto quirks_name = opts["quirks"].as<std::string>();
+    const auto parsed_quirks = Chip8Cpu::parse_quirks(quirks_name);
+    if (!parsed_quirks) {
+        fmt::fprintf(stderr, "Error: unknown quirks \"%s\"\n", quirks_name);
+        return 1;
+    }
+    auto quirks = *parsed_quirks;
+
+    std::optional<RomLibrary> library;
+    const RomLibrary::Rom* rom = nullptr;
+    if (opts.count("library")) {
+        library.emplace(opts["library"].as<std::string>());
+        if (!path.empty() && !(rom = library->find(path.generic_u8string()))) {
+            throw IOException("ROM {} is not in the library", path.u8string());
+        }
+    }
+
+    std::vector<KeyEvent> events;
+    std::uint64_t movie_length = 0;
+    if (opts.count("keys")) {
+        events = load_key_script(opts["keys"].as<std::string>());
+    } else if (replaying) {
+        auto movie = Movie::load(opts["replay"].as<std::string>());
+        if (library && !rom && !(rom = library->find(movie.rom_hash))) {
+            throw IOException("The movie's ROM is not in the library");
+        }
+        if (movie.rom_hash != (rom ? rom->hash : rom_hash(path))) {
+            throw IOException("Movie was recorded with a different ROM");
+        }
+        seed = movie.seed;
+        quirks = movie.quirks;
+        // the movie's rate goes to the scheduler as is, a rounded one would move the timer ticks;
+        // ipf only sets the frame length for --frames and the hashes
+        rate = movie.rate;
+        ipf = std::max<std::uint64_t>(rate / Scheduler::timer_rate, 1);
+        movie_length = movie.length ? movie.length : (movie.events.empty() ? 0 : movie.events.back().cycle);
+        events = std::move(movie.events);
+    }
+
+    std::uint64_t total = movie_length;
+    if (opts.count("cycles")) {
+        total = opts["cycles"].as<std::uint64_t>();
+    } else if (opts.count("frames")) {
+        total = opts["frames"].as<std::uint64_t>() * ipf;
+    }
+
+    Chip8Cpu chip8;
+    chip8.seed(seed);
+    chip8.set_quirks(quirks);
+    const auto engine = opts["engine"].as<std::string>();
+    if (engine == "block") {
+        chip8.set_engine(Chip8Cpu::Engine::block);
+    } else if (engine != "interpreter") {
+        fmt::fprintf(stderr, "Error: unknown engine \"%s\"\n", engine);
+        return 1;
+    }
+    if (rom) {
+        chip8.load_rom(rom->data);
+    } else {
+        chip8.load_rom(path);
+    }
+    if (opts.count("predecode")) {
+        const auto starts = CodeMap{chip8}.block_starts();
+        chip8.predecode(starts);
+    }
+
+    std::optional<MovieRecorder> recorder;
+    if (opts.count("record")) {
+        recorder.emplace(opts["record"].as<std::string>(), seed, rate, quirks, rom ? rom->hash : rom_hash(path));
+        for (const auto& e : events) {
+            if (e.cycle <= total) {
+                recorder->record(e);
+            }
+        }
+    }
+
+#ifdef CHIP8_PROFILING
+    Profiler profiler;
+    if (opts.count("profile")) {
+        chip8.attach_profiler(&profiler);
+    }
+#endif
+
+    Scheduler scheduler{chip8, rate};
+    MoviePlayer player{scheduler, std::move(events)};
+    int status = 0;
+
+    std::ofstream hashes;
+    if (opts.count("hashes")) {
+        hashes.open(opts["hashes"].as<std::string>());
+        if (!hashes) {
+            throw IOException("Can't write file {}", opts["hashes"].as<std::string>());
+        }
+    }
+
+    // without --wav nothing gets synthesized at all
+    std::optional<AudioStream> audio;
+    std::optional<WavWriter> wav;
+    if (opts.count("wav")) {
+        audio.emplace(opts["sample-rate"].as<unsigned>());
+        wav.emplace(opts["wav"].as<std::string>(), audio->sample_rate());
+        scheduler.set_audio(&*audio);
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    try {
+        if (hashes.is_open() || wav) {
+            // both hashes are maintained by the core, so streaming them costs next to nothing per frame
+            for (std::uint64_t frame = 1; scheduler.cycles() < total; frame++) {
+                player.run(std::min(frame * ipf, total));
+                if (hashes.is_open()) {
+                    fmt::print(hashes, "{} {:016x} {:016x}\n", frame, chip8.framebuffer_hash(), chip8.state_hash());
+                }
+                if (wav) {
+                    wav->drain(*audio);
+                }
+            }
+        } else {
+            player.run(total);
+        }
+    } catch (const Exception& e) {
+        fmt::print("fault: {}: {}\n", e.what(), e.message());
+        status = 2;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    const auto cycles = scheduler.cycles();
+    if (recorder) {
+        recorder->finish(cycles);
+    }
+    if (wav) {
+        wav->drain(*audio);
+        wav->finish();
+    }
+
+#ifdef CHIP8_PROFILING
+    if (opts.count("profile")) {
+        const auto prefix = opts["profile"].as<std::string>();
+        std::ofstream flat{prefix + ".txt"};
+        profiler.write_flat(flat);
+        std::ofstream folded{prefix + ".folded"};
+        profiler.write_folded(folded);
+        if (!flat || !folded) {
+            throw IOException("Can't write profile {}", prefix);
+        }
+    }
+#endif
+
+    dump_state(chip8);
+    fmt::print("seed: {}\n", seed);
+    fmt::print("cycles: {}\n", cycles);
+    fmt::print("frames: {}\n", cycles / ipf);
+    fmt::print("time: {:.3f} ms\n", elapsed.count() * 1000);
+    fmt::print("speed: {:.2f} MIPS\n", elapsed.count() > 0 ? cycles / elapsed.count() / 1e6 : 0.0);
+
+    return status;
+} catch (const Exception& e) {
+    fmt::fprintf(stderr, "Error: %s: %s\n", e.what(), std::string{e.message()});
+    return 1;
+} catch (const std::exception& e) {
+    fmt::fprintf(stderr, "Error: %s\n", e.what());
+    return 1;
+} catch (...) {
+    fmt::fprintf(stderr, "Unknown exception occured.\n");
+    throw;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "chip8.h"
+#include "utils/ring_buffer.h"
+
+/**
+ * Turns the sound state of a machine into 16 bit mono samples. The scheduler
+ * calls tick() at every 60 Hz timer tick, which synthesizes exactly the samples
+ * that tick is worth and queues them for a sink on another thread to read().
+ * Plain CHIP-8 gets a square wave, XO-CHIP plays its 1 bit pattern at the
+ * selected pitch; the phase carries over between ticks, so tones stay clean.
+ */
+class AudioStream
+{
+public:
+    static constexpr unsigned default_sample_rate = 44100;
+    // about 185 ms at the default rate, a sink that lags further behind loses samples
+    static constexpr std::size_t default_capacity = 8192;
+    static constexpr std::int16_t volume = 8000;
+
+    explicit AudioStream(unsigned sample_rate = default_sample_rate, std::size_t capacity = default_capacity);
+
+    unsigned sample_rate() const noexcept
+    {
+        return m_sample_rate;
+    }
+
+    // producer: queues one timer tick of sound, to be called before the timers count down
+    void tick(const Chip8Cpu& chip8);
+
+    // consumer: fills all count samples, with silence where the producer fell behind;
+    // returns how many were actual samples
+    std::size_t read(std::int16_t* out, std::size_t count) noexcept;
+
+    // consumer: samples that can be read right away
+    std::size_t available() const noexcept
+    {
+        return m_queue.size();
+    }
+
+private:
+    unsigned m_sample_rate;
+    utils::RingBuffer<std::int16_t> m_queue;
+    std::vector<std::int16_t> m_samples;
+
+    // samples owed to the sink, in units of 1/timer_rate to avoid rounding drift
+    std::uint64_t m_pending = 0;
+    // position within the 128 bit pattern
+    double m_phase = 0;
+    std::uint8_t m_pitch = 0;
+    double m_step = 0;
+};
+
+// writes 16 bit mono PCM to a WAV file, the header gets its final sizes on finish()
+class WavWriter
+{
+public:
+    WavWriter(const std::filesystem::path& path, unsigned sample_rate);
+    ~WavWriter();
+    WavWriter(const WavWriter&) = delete;
+    void operator =(const WavWriter&) = delete;
+
+    void write(const std::int16_t* samples, std::size_t count);
+
+    // takes whatever the stream has queued
+    void drain(AudioStream& stream);
+
+    void finish();
+
+private:
+    std::ofstream m_out;
+    std::uint32_t m_samples = 0;
+    bool m_finished = false;
+};
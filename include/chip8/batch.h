@@ -0,0 +1,576 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "chip8.h"
+#include "utils/span.h"
+
+/**
+ * N machines running the same ROM side by side, for populations that only differ
+ * in their seeds and inputs. Registers, program counters, I, the stacks and the
+ * timers are stored lane by lane as structure of arrays. The machines at the lowest
+ * program counter run its instruction together, which lets diverged loops meet
+ * again at their head; while all of them agree they run as one until an instruction
+ * could send them different ways. Register arithmetic, I, the timers, jumps, skips,
+ * calls and returns are byte- and word-wide loops over the lanes the compiler
+ * vectorizes (SSE2, AVX2 where the target has it), everything that touches memory,
+ * the display or the keys runs on each machine's own Chip8Cpu with its registers
+ * handed over for the one step.
+ */
+template <std::size_t N>
+class Chip8Batch
+{
+public:
+    static_assert(N > 0, "a batch needs at least one machine");
+
+    static constexpr std::size_t lanes = N;
+
+    explicit Chip8Batch(Chip8Cpu::Quirks quirks = Chip8Cpu::Quirks::chip8)
+        : m_quirks(quirks), m_flags(Chip8Cpu::quirk_flags(quirks)), m_machines(N)
+    {
+        for (auto& machine : m_machines) {
+            machine.set_quirks(quirks);
+        }
+        m_memory_size = m_machines[0].memory_limit();
+        // opcode 0000 is what memory holds before anything is loaded, so every slot starts out valid
+        m_decoded.assign(m_memory_size, Chip8Cpu::decode(0, quirks));
+        m_differs.assign(m_memory_size, 0);
+        m_pc.fill(0x200);
+    }
+
+    void load_rom(utils::span<const std::uint8_t> rom)
+    {
+        for (auto& machine : m_machines) {
+            machine.load_rom(rom);
+        }
+        compare_memory(0, m_memory_size);
+    }
+
+    void seed(std::size_t lane, std::uint32_t value)
+    {
+        m_machines[lane].seed(value);
+    }
+
+    void set_key(std::size_t lane, std::uint8_t key, bool down) noexcept
+    {
+        m_machines[lane].keys[key] = down;
+    }
+
+    // Chip8Cpu::try_run() on every machine: each runs cycles instructions unless it faults first
+    std::array<Chip8Cpu::RunResult, N> run(std::uint64_t cycles);
+
+    void count_down() noexcept
+    {
+        for (std::size_t l = 0; l < N; l++) {
+            m_delay_timer[l] -= m_delay_timer[l] != 0;
+            m_sound_timer[l] -= m_sound_timer[l] != 0;
+        }
+    }
+
+    // the machine in a lane with its registers brought up to date, e.g. to hash or render it
+    const Chip8Cpu& machine(std::size_t lane)
+    {
+        store_lane(lane);
+        return m_machines[lane];
+    }
+
+    // instructions executed and the steps they took, one step runs an instruction on every
+    // machine at its address: instructions() / steps() machines in lockstep on average
+    std::uint64_t instructions() const noexcept
+    {
+        return m_instructions;
+    }
+
+    std::uint64_t steps() const noexcept
+    {
+        return m_steps;
+    }
+
+private:
+    // 0xFF for the lanes an operation applies to, 0 for the others
+    using Mask = std::array<std::uint8_t, N>;
+    using Operation = Chip8Cpu::Operation;
+
+    // byte-wide all the way, so that a vector holds as many lanes as it can
+    static std::uint8_t select(std::uint8_t mask, std::uint8_t old_value, std::uint8_t new_value) noexcept
+    {
+        return static_cast<std::uint8_t>((old_value & ~mask) | (new_value & mask));
+    }
+
+    static std::uint16_t select(std::uint16_t mask, std::uint16_t old_value, std::uint16_t new_value) noexcept
+    {
+        return static_cast<std::uint16_t>((old_value & ~mask) | (new_value & mask));
+    }
+
+    std::uint16_t fetch(std::size_t lane, std::uint16_t addr) const noexcept
+    {
+        const auto* memory = m_machines[lane].memory.data();
+        return static_cast<std::uint16_t>(memory[addr] << 8 | memory[addr + 1]);
+    }
+
+    // brings m_differs up to date for the addresses [from, to)
+    void compare_memory(std::uint32_t from, std::uint32_t to) noexcept
+    {
+        to = std::min(to, m_memory_size);
+        for (auto addr = from; addr < to; addr++) {
+            const auto value = m_machines[0].memory[addr];
+            std::uint8_t differs = 0;
+            for (std::size_t l = 1; l < N; l++) {
+                differs |= m_machines[l].memory[addr] != value;
+            }
+            m_differs[addr] = differs;
+        }
+    }
+
+    // the registers of a lane into its machine and back, around a step of the interpreter
+    void store_lane(std::size_t lane) noexcept;
+    void load_lane(std::size_t lane) noexcept;
+    Chip8Cpu::Fault step_lane(std::size_t lane) noexcept;
+
+    // instructions that can't fault and take every machine to the same address
+    static constexpr bool stays_together(Operation op) noexcept
+    {
+        switch (op) {
+        case Operation::ld_imm:
+        case Operation::add_imm:
+        case Operation::ld_reg:
+        case Operation::or_reg:
+        case Operation::and_reg:
+        case Operation::xor_reg:
+        case Operation::add_reg:
+        case Operation::sub_reg:
+        case Operation::subn_reg:
+        case Operation::shr:
+        case Operation::shl:
+        case Operation::ld_i:
+        case Operation::add_i:
+        case Operation::ld_vx_dt:
+        case Operation::ld_dt:
+        case Operation::ld_st:
+        case Operation::rnd:
+        case Operation::jp:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // runs the machines in group, all of them at pc, for up to budget instructions that
+    // stay_together(), returns how many it ran
+    std::uint16_t lockstep(std::uint16_t pc, const Mask& group, std::uint16_t budget);
+    // runs ins on the lanes in group, true if any of them faulted, see m_faulted
+    bool execute(const Chip8Cpu::Instruction& ins, const Mask& group);
+    // the instruction at the common program counter on each lane in group on its own
+    bool execute_scalar(const Mask& group);
+    void skip_if(const Mask& group, const Mask& condition) noexcept;
+
+    Chip8Cpu::Quirks m_quirks;
+    Chip8Cpu::QuirkFlags m_flags;
+    std::uint32_t m_memory_size;
+    std::vector<Chip8Cpu> m_machines;
+    // per address, checked against the opcode each time, memory may be written
+    std::vector<Chip8Cpu::Instruction> m_decoded;
+    // per address, whether the machines have written different values there, only
+    // then do they have to fetch their opcodes one by one
+    std::vector<std::uint8_t> m_differs;
+
+    alignas(32) std::array<std::array<std::uint8_t, N>, Chip8Cpu::reg_size> m_V{};
+    alignas(32) std::array<std::uint16_t, N> m_pc{};
+    alignas(32) std::array<std::uint16_t, N> m_I{};
+    alignas(32) std::array<std::array<std::uint16_t, N>, Chip8Cpu::stack_size> m_stack{};
+    alignas(32) std::array<std::uint8_t, N> m_sp{};
+    alignas(32) std::array<std::uint8_t, N> m_delay_timer{};
+    alignas(32) std::array<std::uint8_t, N> m_sound_timer{};
+
+    // the lanes that faulted in the current run
+    Mask m_faulted{};
+
+    std::uint64_t m_instructions = 0;
+    std::uint64_t m_steps = 0;
+};
+
+template <std::size_t N>
+void Chip8Batch<N>::store_lane(std::size_t lane) noexcept
+{
+    auto& cpu = m_machines[lane];
+    for (int r = 0; r < Chip8Cpu::reg_size; r++) {
+        cpu.V[r] = m_V[r][lane];
+    }
+    for (int s = 0; s < Chip8Cpu::stack_size; s++) {
+        cpu.stack[s] = m_stack[s][lane];
+    }
+    cpu.pc = m_pc[lane];
+    cpu.I = m_I[lane];
+    cpu.sp = m_sp[lane];
+    cpu.delay_timer = m_delay_timer[lane];
+    cpu.sound_timer = m_sound_timer[lane];
+}
+
+template <std::size_t N>
+void Chip8Batch<N>::load_lane(std::size_t lane) noexcept
+{
+    const auto& cpu = m_machines[lane];
+    for (int r = 0; r < Chip8Cpu::reg_size; r++) {
+        m_V[r][lane] = cpu.V[r];
+    }
+    for (int s = 0; s < Chip8Cpu::stack_size; s++) {
+        m_stack[s][lane] = cpu.stack[s];
+    }
+    m_pc[lane] = cpu.pc;
+    m_I[lane] = cpu.I;
+    m_sp[lane] = cpu.sp;
+    m_delay_timer[lane] = cpu.delay_timer;
+    m_sound_timer[lane] = cpu.sound_timer;
+}
+
+template <std::size_t N>
+Chip8Cpu::Fault Chip8Batch<N>::step_lane(std::size_t lane) noexcept
+{
+    store_lane(lane);
+    const auto fault = m_machines[lane].try_step();
+    load_lane(lane);
+    return fault;
+}
+
+template <std::size_t N>
+std::array<Chip8Cpu::RunResult, N> Chip8Batch<N>::run(std::uint64_t cycles)
+{
+    std::array<Chip8Cpu::RunResult, N> results;
+    results.fill({0, Chip8Cpu::Fault::none, Chip8Cpu::StopReason::cycles});
+    m_faulted.fill(0);
+
+    // the budget is spent in chunks that fit the 16 bit lanes the program counters use
+    for (std::uint64_t offset = 0; offset < cycles;) {
+        const auto chunk = static_cast<std::uint16_t>(std::min<std::uint64_t>(cycles - offset, 0xFFFF));
+        alignas(32) std::array<std::uint16_t, N> left;
+        alignas(32) std::array<std::uint16_t, N> active;
+        bool any = false;
+        for (std::size_t l = 0; l < N; l++) {
+            left[l] = chunk;
+            active[l] = m_faulted[l] ? 0 : 0xFFFF;
+            any |= !m_faulted[l];
+        }
+
+        while (any) {
+            // the lowest program counter goes first, the machines further on wait for it
+            std::uint16_t pc = 0xFFFF;
+            for (std::size_t l = 0; l < N; l++) {
+                pc = std::min<std::uint16_t>(pc, m_pc[l] | ~active[l]);
+            }
+
+            alignas(32) std::array<std::uint16_t, N> group16;
+            Mask group;
+            for (std::size_t l = 0; l < N; l++) {
+                group16[l] = active[l] & (m_pc[l] == pc ? 0xFFFF : 0);
+                group[l] = static_cast<std::uint8_t>(group16[l]);
+            }
+
+            // all of them at the same address: no need to look for the lowest one again
+            // until an instruction can send them different ways
+            bool together = true;
+            std::uint16_t budget = 0xFFFF;
+            for (std::size_t l = 0; l < N; l++) {
+                together &= group16[l] == active[l];
+                budget = std::min<std::uint16_t>(budget, left[l] | ~active[l]);
+            }
+            if (together) {
+                if (const auto steps = lockstep(pc, group, budget)) {
+                    std::uint16_t remaining = 0;
+                    for (std::size_t l = 0; l < N; l++) {
+                        left[l] -= steps & active[l];
+                        active[l] &= left[l] ? 0xFFFF : 0;
+                        remaining |= active[l];
+                    }
+                    any = remaining != 0;
+                    continue;
+                }
+            }
+
+            bool faulted;
+            if (pc + 1u >= m_memory_size) {
+                faulted = execute_scalar(group);
+            } else {
+                auto opcode = fetch(0, pc);
+                if (m_differs[pc] | m_differs[pc + 1]) {
+                    // machines that wrote their code differently part ways here
+                    const auto leader = static_cast<std::size_t>(std::find(group.begin(), group.end(), 0xFF) - group.begin());
+                    opcode = fetch(leader, pc);
+                    for (std::size_t l = leader + 1; l < N; l++) {
+                        group[l] &= fetch(l, pc) == opcode ? 0xFF : 0;
+                        group16[l] = static_cast<std::uint16_t>(static_cast<std::int8_t>(group[l]));
+                    }
+                }
+
+                auto& ins = m_decoded[pc];
+                if (ins.opcode != opcode) {
+                    ins = Chip8Cpu::decode(opcode, m_quirks);
+                }
+                faulted = execute(ins, group);
+            }
+            m_steps++;
+
+            // a faulting instruction doesn't count, as in Chip8Cpu::try_run()
+            if (faulted) {
+                for (std::size_t l = 0; l < N; l++) {
+                    const auto mask = static_cast<std::uint16_t>(static_cast<std::int8_t>(m_faulted[l]));
+                    group16[l] &= ~mask;
+                    active[l] &= ~mask;
+                }
+            }
+            std::uint16_t remaining = 0;
+            for (std::size_t l = 0; l < N; l++) {
+                left[l] -= group16[l] & 1;
+                active[l] &= left[l] ? 0xFFFF : 0;
+                remaining |= active[l];
+            }
+            any = remaining != 0;
+        }
+
+        for (std::size_t l = 0; l < N; l++) {
+            results[l].cycles += chunk - left[l];
+        }
+        offset += chunk;
+    }
+
+    for (std::size_t l = 0; l < N; l++) {
+        m_instructions += results[l].cycles;
+        if (m_faulted[l]) {
+            results[l].fault = m_machines[l].last_fault().fault;
+            results[l].reason = Chip8Cpu::StopReason::fault;
+        }
+    }
+    return results;
+}
+
+template <std::size_t N>
+std::uint16_t Chip8Batch<N>::lockstep(std::uint16_t pc, const Mask& group, std::uint16_t budget)
+{
+    std::uint16_t steps = 0;
+    while (steps < budget && pc + 1u < m_memory_size && !(m_differs[pc] | m_differs[pc + 1])) {
+        const auto opcode = fetch(0, pc);
+        auto& ins = m_decoded[pc];
+        if (ins.opcode != opcode) {
+            ins = Chip8Cpu::decode(opcode, m_quirks);
+        }
+        if (!stays_together(ins.op)) {
+            break;
+        }
+        execute(ins, group);
+        pc = ins.op == Operation::jp ? ins.nnn() : static_cast<std::uint16_t>(pc + 2);
+        steps++;
+    }
+    m_steps += steps;
+    return steps;
+}
+
+template <std::size_t N>
+bool Chip8Batch<N>::execute_scalar(const Mask& group)
+{
+    bool faulted = false;
+    for (std::size_t l = 0; l < N; l++) {
+        if (group[l] && step_lane(l) != Chip8Cpu::Fault::none) {
+            m_faulted[l] = 0xFF;
+            faulted = true;
+        }
+    }
+    return faulted;
+}
+
+template <std::size_t N>
+void Chip8Batch<N>::skip_if(const Mask& group, const Mask& condition) noexcept
+{
+    for (std::size_t l = 0; l < N; l++) {
+        const auto mask = static_cast<std::uint16_t>(static_cast<std::int8_t>(group[l]));
+        m_pc[l] = select(mask, m_pc[l], m_pc[l] + (condition[l] ? 4 : 2));
+    }
+}
+
+template <std::size_t N>
+bool Chip8Batch<N>::execute(const Chip8Cpu::Instruction& ins, const Mask& group)
+{
+    const auto x = ins.x;
+    const auto y = ins.y;
+    auto& vx = m_V[x];
+    auto& vy = m_V[y];
+    auto& vf = m_V[0xF];
+    const auto& m = group;
+    Mask condition;
+    Mask value;
+
+    // the same order of writes as the handlers, VF may be an operand too
+    switch (ins.op) {
+    case Operation::ld_imm:
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], ins.nn);
+        }
+        break;
+    case Operation::add_imm:
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], vx[l] + ins.nn);
+        }
+        break;
+    case Operation::ld_reg:
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], vy[l]);
+        }
+        break;
+    case Operation::or_reg:
+    case Operation::and_reg:
+    case Operation::xor_reg:
+        for (std::size_t l = 0; l < N; l++) {
+            const int result = ins.op == Operation::or_reg ? (vx[l] | vy[l])
+                             : ins.op == Operation::and_reg ? (vx[l] & vy[l]) : (vx[l] ^ vy[l]);
+            vx[l] = select(m[l], vx[l], result);
+        }
+        if (m_flags.logic_reset_vf) {
+            for (std::size_t l = 0; l < N; l++) {
+                vf[l] = select(m[l], vf[l], 0);
+            }
+        }
+        break;
+    case Operation::add_reg:
+        for (std::size_t l = 0; l < N; l++) {
+            vf[l] = select(m[l], vf[l], static_cast<std::uint8_t>(vx[l] + vy[l]) < vx[l]);
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], vx[l] + vy[l]);
+        }
+        break;
+    case Operation::sub_reg:
+        for (std::size_t l = 0; l < N; l++) {
+            vf[l] = select(m[l], vf[l], vx[l] >= vy[l]);
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], vx[l] - vy[l]);
+        }
+        break;
+    case Operation::subn_reg:
+        for (std::size_t l = 0; l < N; l++) {
+            vf[l] = select(m[l], vf[l], vy[l] < vx[l]);
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], vy[l] - vx[l]);
+        }
+        break;
+    case Operation::shr:
+        value = m_V[m_flags.shift_vy ? y : x];
+        for (std::size_t l = 0; l < N; l++) {
+            vf[l] = select(m[l], vf[l], value[l] & 0x01);
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], value[l] >> 1);
+        }
+        break;
+    case Operation::shl:
+        value = m_V[m_flags.shift_vy ? y : x];
+        for (std::size_t l = 0; l < N; l++) {
+            vf[l] = select(m[l], vf[l], value[l] >> 7);
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], value[l] << 1);
+        }
+        break;
+    case Operation::ld_i:
+        for (std::size_t l = 0; l < N; l++) {
+            m_I[l] = select(static_cast<std::uint16_t>(static_cast<std::int8_t>(m[l])), m_I[l], ins.nnn());
+        }
+        break;
+    case Operation::add_i:
+        for (std::size_t l = 0; l < N; l++) {
+            m_I[l] = select(static_cast<std::uint16_t>(static_cast<std::int8_t>(m[l])), m_I[l], m_I[l] + vx[l]);
+        }
+        break;
+    case Operation::ld_vx_dt:
+        for (std::size_t l = 0; l < N; l++) {
+            vx[l] = select(m[l], vx[l], m_delay_timer[l]);
+        }
+        break;
+    case Operation::ld_dt:
+        for (std::size_t l = 0; l < N; l++) {
+            m_delay_timer[l] = select(m[l], m_delay_timer[l], vx[l]);
+        }
+        break;
+    case Operation::ld_st:
+        for (std::size_t l = 0; l < N; l++) {
+            m_sound_timer[l] = select(m[l], m_sound_timer[l], vx[l]);
+        }
+        break;
+    case Operation::rnd:
+        for (std::size_t l = 0; l < N; l++) {
+            if (m[l]) {
+                vx[l] = ins.nn & m_machines[l].rng.byte();
+            }
+        }
+        break;
+    case Operation::jp:
+        for (std::size_t l = 0; l < N; l++) {
+            m_pc[l] = select(static_cast<std::uint16_t>(static_cast<std::int8_t>(m[l])), m_pc[l], ins.nnn());
+        }
+        // the other cases move past the instruction below
+        return false;
+    case Operation::se_imm:
+    case Operation::sne_imm:
+    case Operation::se_reg:
+    case Operation::sne_reg:
+        // how far a skip goes depends on each machine's memory on XO-CHIP
+        if (m_flags.long_skips) {
+            return execute_scalar(group);
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            const int other = ins.op == Operation::se_imm || ins.op == Operation::sne_imm ? ins.nn : vy[l];
+            const bool equal = vx[l] == other;
+            condition[l] = ins.op == Operation::se_imm || ins.op == Operation::se_reg ? equal : !equal;
+        }
+        skip_if(group, condition);
+        return false;
+    case Operation::call:
+        // overflows fault, which the interpreter reports
+        for (std::size_t l = 0; l < N; l++) {
+            if (m[l] && m_sp[l] == Chip8Cpu::stack_size) {
+                return execute_scalar(group);
+            }
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            if (m[l]) {
+                m_stack[m_sp[l]++][l] = m_pc[l];
+                m_pc[l] = ins.nnn();
+            }
+        }
+        return false;
+    case Operation::ret:
+        for (std::size_t l = 0; l < N; l++) {
+            if (m[l] && m_sp[l] == 0) {
+                return execute_scalar(group);
+            }
+        }
+        for (std::size_t l = 0; l < N; l++) {
+            if (m[l]) {
+                m_pc[l] = static_cast<std::uint16_t>(m_stack[--m_sp[l]][l] + 2);
+            }
+        }
+        return false;
+    case Operation::ld_bcd:
+    case Operation::ld_store:
+    case Operation::save_range: {
+        // all of them write at most a register's worth of bytes from I on
+        const auto start = m_I;
+        const bool faulted = execute_scalar(group);
+        for (std::size_t l = 0; l < N; l++) {
+            if (m[l]) {
+                compare_memory(start[l], start[l] + Chip8Cpu::reg_size);
+            }
+        }
+        return faulted;
+    }
+    default:
+        return execute_scalar(group);
+    }
+
+    for (std::size_t l = 0; l < N; l++) {
+        m_pc[l] = select(static_cast<std::uint16_t>(static_cast<std::int8_t>(m[l])), m_pc[l], m_pc[l] + 2);
+    }
+    return false;
+}
@@ -3,17 +3,181 @@
 #include <array>
 #include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include "exceptions.h"
+#include "utils/random.h"
+#include "utils/span.h"
+
+class Profiler;
 
 class Chip8Cpu
 {
 public:
     Chip8Cpu();
+    ~Chip8Cpu();
+    Chip8Cpu(Chip8Cpu&&) noexcept;
+    Chip8Cpu& operator =(Chip8Cpu&&) noexcept;
+
+    // interpreter runs one cached instruction per dispatch, block translates
+    // straight-line code up to the next jump, call, return or skip and runs it in one go,
+    // native runs the ROM translated to C++ ahead of time that attach_native() set
+    enum class Engine
+    {
+        interpreter,
+        block,
+        native
+    };
+
+    void set_engine(Engine engine);
+    Engine engine() const noexcept
+    {
+        return m_engine;
+    }
+
+    // behaviour that differs between interpreters: shifts, FX55/FX65, BNNN, sprite wrapping.
+    // chip8 matches most modern ROMs, cosmac_vip is the original interpreter, schip adds the
+    // 128x64 mode, scrolling and 16x16 sprites, xochip adds 64 KiB of memory, a second bit
+    // plane and audio patterns on top
+    enum class Quirks : std::uint8_t
+    {
+        chip8,
+        schip,
+        cosmac_vip,
+        xochip
+    };
+
+    void set_quirks(Quirks quirks);
+    Quirks quirks() const noexcept
+    {
+        return m_quirks;
+    }
+
+    // the names the frontends take on the command line, quirks_names() lists them all
+    static const char* quirks_name(Quirks quirks) noexcept;
+    static std::optional<Quirks> parse_quirks(std::string_view name) noexcept;
+    static std::string quirks_names();
+
+    // what code running instructions outside the handlers, translated or batched, has to mirror
+    struct QuirkFlags
+    {
+        // 8XY6/8XYE shift VY into VX
+        bool shift_vy;
+        // 8XY1/8XY2/8XY3 clear VF
+        bool logic_reset_vf;
+        // skips jump over both words of F000 NNNN
+        bool long_skips;
+    };
+
+    static QuirkFlags quirk_flags(Quirks quirks) noexcept;
+
+    // CXNN draws from a generator owned by each CPU, which starts from seed 0 unless set here
+    void seed(std::uint32_t value);
+
+    enum class Fault : std::uint8_t
+    {
+        none,
+        invalid_opcode,
+        unsupported_opcode,
+        stack_overflow,
+        stack_underflow,
+        key_out_of_range,
+        font_out_of_range,
+        memory_out_of_range,
+        pc_out_of_range
+    };
+
+    struct FaultInfo
+    {
+        Fault fault = Fault::none;
+        std::uint16_t pc = 0;
+        std::uint16_t opcode = 0;
+    };
+
+    // conditions that end run_until() early, combined as a mask
+    enum StopOn : std::uint8_t
+    {
+        stop_on_draw = 1 << 0,      // after anything that changed the display
+        stop_on_key_wait = 1 << 1,  // FX0A found no key pressed
+        stop_on_exit = 1 << 2,      // 00FD halted the program
+    };
+
+    enum class StopReason : std::uint8_t
+    {
+        cycles,
+        draw,
+        key_wait,
+        exit,
+        fault
+    };
+
+    struct RunResult
+    {
+        // instructions that ran, a waiting FX0A counts but a faulting instruction doesn't
+        std::uint64_t cycles;
+        Fault fault;
+        StopReason reason;
+    };
+
+    // the access translated code has to the machine, defined in native.h
+    struct Native;
+    // runs up to cycles instructions like try_run_until() with the stop mask in native
+    using NativeFn = RunResult (*)(Native& native, std::uint64_t cycles);
+
+    // the machine has to run the ROM and quirks the function was translated from,
+    // NativeProgram::load() takes care of that; nullptr leaves the native engine interpreting
+    void attach_native(NativeFn run) noexcept
+    {
+        m_native = run;
+    }
 
     void load_rom(const std::filesystem::path& path);
+    // one copy into memory, nothing else; reset() reads the image again, so it has to
+    // stay alive until then, as the ones in a RomLibrary do
+    void load_rom(utils::span<const std::uint8_t> rom);
+
+    // decodes the blocks starting at these addresses now instead of on their first run,
+    // e.g. the ones a CodeMap found; writes invalidate them as usual
+    void predecode(utils::span<const std::uint16_t> block_starts);
+
+#ifdef CHIP8_PROFILING
+    // an attached profiler grows its call tree as it goes, the caches never allocate while running
+    static constexpr bool runs_noexcept = false;
+#else
+    static constexpr bool runs_noexcept = true;
+#endif
+
+    // step() and run() throw on faults, the try_ variants stop at the faulting
+    // instruction instead and leave the details in last_fault()
     void step();
+    std::uint64_t run(std::uint64_t cycles);
+    RunResult run_until(std::uint64_t cycles, std::uint8_t stop_on);
+    Fault try_step() noexcept(runs_noexcept);
+    RunResult try_run(std::uint64_t cycles) noexcept(runs_noexcept);
+    RunResult try_run_until(std::uint64_t cycles, std::uint8_t stop_on) noexcept(runs_noexcept);
+
+    const FaultInfo& last_fault() const noexcept
+    {
+        return m_fault;
+    }
+
+    // throws the exception describing last_fault()
+    [[noreturn]] void throw_fault() const;
+
+#ifdef CHIP8_PROFILING
+    // the profiler isn't owned and sees every instruction from now on, nullptr detaches it
+    void attach_profiler(Profiler* profiler) noexcept
+    {
+        m_profiler = profiler;
+    }
+#endif
+
     void clear_screen();
+    // back to how load_rom() left the machine: memory holds only the fonts and the last ROM
     void reset();
     void count_down();
 
@@ -22,36 +186,372 @@ public:
         bool draw;
     } flags{};
 
-    using InterpreterFn = void(*)(Chip8Cpu&);
+    enum class Operation : std::uint8_t
+    {
+        invalid,
+        sys,        // 0NNN
+        cls,        // 00E0
+        ret,        // 00EE
+        scroll_down,    // 00CN
+        scroll_up,      // 00DN
+        scroll_right,   // 00FB
+        scroll_left,    // 00FC
+        exit,       // 00FD
+        lores,      // 00FE
+        hires,      // 00FF
+        jp,         // 1NNN
+        call,       // 2NNN
+        se_imm,     // 3XNN
+        sne_imm,    // 4XNN
+        se_reg,     // 5XY0
+        save_range, // 5XY2
+        load_range, // 5XY3
+        ld_imm,     // 6XNN
+        add_imm,    // 7XNN
+        ld_reg,     // 8XY0
+        or_reg,     // 8XY1
+        and_reg,    // 8XY2
+        xor_reg,    // 8XY3
+        add_reg,    // 8XY4
+        sub_reg,    // 8XY5
+        shr,        // 8XY6
+        subn_reg,   // 8XY7
+        shl,        // 8XYE
+        sne_reg,    // 9XY0
+        ld_i,       // ANNN
+        jp_v0,      // BNNN
+        rnd,        // CXNN
+        drw,        // DXYN
+        skp,        // EX9E
+        sknp,       // EXA1
+        ld_i_long,  // F000 NNNN
+        plane,      // FN01
+        audio,      // F002
+        ld_vx_dt,   // FX07
+        ld_key,     // FX0A
+        ld_dt,      // FX15
+        ld_st,      // FX18
+        add_i,      // FX1E
+        ld_font,    // FX29
+        ld_hifont,  // FX30
+        ld_bcd,     // FX33
+        pitch,      // FX3A
+        ld_store,   // FX55
+        ld_load,    // FX65
+        save_flags, // FX75
+        load_flags, // FX85
+        count
+    };
 
-    static constexpr int screen_width = 64;
-    static constexpr int screen_height = 32;
+    struct Instruction;
+    using InterpreterFn = void(*)(Chip8Cpu&, Instruction);
 
-private:
-    static constexpr std::uint16_t memory_size = 4096;
-    static constexpr std::uint16_t stack_size = 16;
+    // an opcode decoded once: the handler to run and the operands it needs
+    struct Instruction
+    {
+        InterpreterFn fn;
+        std::uint16_t opcode;
+        std::uint8_t x;
+        std::uint8_t y;
+        std::uint8_t n;
+        std::uint8_t nn;
+        Operation op;
+
+        std::uint16_t nnn() const
+        {
+            return opcode & 0x0FFF;
+        }
+    };
+
+    static Instruction decode(std::uint16_t opcode, Quirks quirks = Quirks::chip8);
+
+    static constexpr int lores_width = 64;
+    static constexpr int lores_height = 32;
+    static constexpr int hires_width = 128;
+    static constexpr int hires_height = 64;
+    // bit planes, each row of a plane is packed into row_words words
+    static constexpr int planes = 2;
+    static constexpr int row_words = hires_width / 64;
     static constexpr std::uint16_t reg_size = 16;
     static constexpr std::uint16_t keys_size = 16;
+    // address space of all profiles but xochip
+    static constexpr std::uint32_t memory_size = 0x1000;
+    static constexpr std::uint32_t max_memory_size = 0x10000;
+    static constexpr std::uint16_t stack_size = 16;
+    static constexpr std::uint16_t flags_size = 16;
+    static constexpr std::uint16_t audio_pattern_size = 16;
+    static_assert(hires_height <= 64, "dirty rows are tracked in a 64-bit mask");
+
+    // everything that makes up a running machine, minus the caches derived from it
+    struct State
+    {
+        std::uint16_t I;
+        std::uint16_t pc;
+        std::uint16_t stack[stack_size];
+        std::uint8_t sp;
+        std::uint8_t V[reg_size];
+        std::uint8_t delay_timer;
+        std::uint8_t sound_timer;
+        std::uint8_t keys[keys_size];
+        utils::Random::State rng;
+        bool hires;
+        std::uint8_t plane_mask;
+        std::uint8_t pitch;
+        bool custom_audio;
+        std::uint8_t audio_pattern[audio_pattern_size];
+        std::uint8_t rpl[flags_size];
+        std::uint64_t gfx[planes][hires_height][row_words];
+        // memory_limit() bytes, as much as the profile addresses
+        std::vector<std::uint8_t> memory;
+    };
+
+    State snapshot() const;
+    // only copies and re-decodes the memory pages that differ from the current ones,
+    // the state has to come from a machine with the same memory size
+    void restore(const State& state);
+    // restore() plus a clean slate for faults, flags and dirty rows: the cheap way back
+    // to a template machine, e.g. between fuzzer inputs, instead of constructing a new one
+    void reset(const State& state);
+
+    // kept up to date by every write, so both are O(1) per call: equal machines hash
+    // equal, different ones almost never do. The framebuffer hash covers both planes
+    // and the resolution, the state hash everything snapshot() does
+    std::uint64_t framebuffer_hash() const noexcept;
+    std::uint64_t state_hash() const noexcept;
+
+    // snapshot() in a compact, versioned binary format
+    std::vector<std::uint8_t> save_state() const;
+    void load_state(utils::span<const std::uint8_t> data);
 
-    static constexpr std::uint16_t max_rom_size = 0x1000 - 0x200;
+    // read-only view on the machine state for frontends and tools
+    std::uint16_t program_counter() const noexcept
+    {
+        return pc;
+    }
 
-    static std::array<InterpreterFn, 16> instructions;
+    std::uint16_t address_register() const noexcept
+    {
+        return I;
+    }
+
+    std::uint8_t stack_pointer() const noexcept
+    {
+        return sp;
+    }
+
+    const std::uint8_t* registers() const noexcept
+    {
+        return V;
+    }
+
+    std::uint8_t delay_timer_value() const noexcept
+    {
+        return delay_timer;
+    }
+
+    std::uint8_t sound_timer_value() const noexcept
+    {
+        return sound_timer;
+    }
+
+    // the buzzer sounds as long as the sound timer runs
+    bool sound_on() const noexcept
+    {
+        return sound_timer > 0;
+    }
+
+    // memory the current profile can address
+    std::uint32_t memory_limit() const noexcept
+    {
+        return m_memory_size;
+    }
+
+    utils::span<const std::uint8_t> memory_view() const noexcept
+    {
+        return {memory.data(), m_memory_size};
+    }
+
+    // the display is 64x32 until 00FF switches it to 128x64
+    bool hires() const noexcept
+    {
+        return m_hires;
+    }
+
+    int width() const noexcept
+    {
+        return m_hires ? hires_width : lores_width;
+    }
+
+    int height() const noexcept
+    {
+        return m_hires ? hires_height : lores_height;
+    }
+
+    // each plane row is packed into row_words words, the leftmost pixel is the most significant
+    // bit of the first one; only the first word of the first lores_height rows is used in lores
+    std::uint64_t row(int y, int word = 0, int plane = 0) const noexcept
+    {
+        return gfx[plane][y][word];
+    }
+
+    // colour index of a pixel, bit p is set if plane p is
+    std::uint8_t pixel(int x, int y) const noexcept
+    {
+        std::uint8_t color = 0;
+        for (int p = 0; p < planes; p++) {
+            color |= ((gfx[p][y][x / 64] >> (63 - x % 64)) & 1) << p;
+        }
+        return color;
+    }
+
+    // rows changed by drawing, clearing, scrolling or restoring since the last call, bit y stands for row y
+    std::uint64_t take_dirty_rows() noexcept
+    {
+        const auto rows = dirty_rows;
+        dirty_rows = 0;
+        return rows;
+    }
+
+    // expands row y into width() values looked up by colour index, e.g. texture pixels
+    template <class T>
+    void unpack_row(int y, T* out, const T (&palette)[1 << planes]) const noexcept
+    {
+        for (int w = 0; w < width() / 64; w++) {
+            const auto bits0 = gfx[0][y][w];
+            const auto bits1 = gfx[1][y][w];
+            for (int x = 0; x < 64; x++) {
+                const auto shift = 63 - x;
+                out[w * 64 + x] = palette[((bits0 >> shift) & 1) | (((bits1 >> shift) & 1) << 1)];
+            }
+        }
+    }
+
+    // XO-CHIP sound: a 128 bit sample pattern played at 4000 * 2^((pitch - 64) / 48) Hz
+    // while the sound timer runs, custom_audio() stays false until F002 loaded one
+    const std::uint8_t* audio_pattern() const noexcept
+    {
+        return m_audio_pattern;
+    }
+
+    std::uint8_t pitch() const noexcept
+    {
+        return m_pitch;
+    }
+
+    bool custom_audio() const noexcept
+    {
+        return m_custom_audio;
+    }
+
+private:
+    static constexpr std::uint16_t rom_start = 0x200;
+    static constexpr std::uint16_t max_block_length = 64;
+
+    struct BlockCache;
+
+    // keeps the registers of its machines in its own arrays and hands them back for a step
+    template <std::size_t N>
+    friend class Chip8Batch;
+
+    using HandlerTable = std::array<InterpreterFn, static_cast<std::size_t>(Operation::count)>;
+
+    template <class Policy>
+    static const HandlerTable handlers;
+    static const HandlerTable* const handler_tables[];
+
+    static const Instruction undecoded;
+
+    static void decode_and_execute(Chip8Cpu& cpu, Instruction ins);
+    static bool ends_block(Operation op);
+
+    static constexpr std::uint8_t stop_on_fault = 1 << 7;
+
+    RunResult run_blocks(std::uint64_t cycles, std::uint8_t mask) noexcept(runs_noexcept);
+    void build_block(std::uint16_t start);
+
+    void execute(const Instruction& ins)
+    {
+#ifdef CHIP8_PROFILING
+        if (m_profiler) {
+            return execute_profiled(ins);
+        }
+#endif
+        ins.fn(*this, ins);
+    }
+
+#ifdef CHIP8_PROFILING
+    void execute_profiled(const Instruction& ins);
+#endif
+    static StopReason stop_reason(std::uint8_t events) noexcept;
+    void raise(Fault fault, Instruction ins) noexcept;
+
+    template <class Policy>
+    void skip_next() noexcept;
+    void clear_planes(std::uint8_t mask);
+    // positive amounts scroll down or right, only the selected planes move
+    void scroll_vertical(int rows);
+    void scroll_horizontal(int pixels);
+    void set_hires(bool hires);
+
+    std::uint64_t all_rows() const noexcept
+    {
+        return ~std::uint64_t{0} >> (64 - height());
+    }
+
+    std::uint16_t fetch(std::uint16_t addr) const;
+    // every memory write goes through here to keep the memory hash current
+    void store(std::uint32_t addr, const std::uint8_t* data, std::size_t size);
+    void rehash_framebuffer() noexcept;
+    void rehash_memory() noexcept;
+    void invalidate(std::uint16_t addr, std::uint16_t len);
+    void invalidate_all();
 
-    std::uint16_t opcode = 0;
     std::uint16_t I = 0;
     std::uint16_t pc = 0x200;
-    std::uint16_t stack[stack_size];
+    std::uint16_t stack[stack_size] = {};
     std::uint8_t sp = 0;
-    std::uint8_t V[reg_size]; //registers
+    std::uint8_t V[reg_size] = {}; //registers
     std::uint8_t delay_timer = 0;
     std::uint8_t sound_timer = 0;
+    utils::Random rng;
 
 public:
     std::uint8_t keys[keys_size] = {};
-    std::uint8_t gfx[screen_height][screen_width] = {};
 
 private:
-    std::uint8_t memory[memory_size];
+    std::uint64_t gfx[planes][hires_height][row_words] = {};
+    std::uint64_t dirty_rows = 0;
+    bool m_hires = false;
+    std::uint8_t m_plane_mask = 1;
+    std::uint8_t m_pitch = 64;
+    bool m_custom_audio = false;
+    std::uint8_t m_audio_pattern[audio_pattern_size] = {};
+    // SCHIP's persistent "RPL user flags", FX75/FX85
+    std::uint8_t rpl[flags_size] = {};
+    // sized to the profile, 4 KiB unless it's xochip
+    std::vector<std::uint8_t> memory = std::vector<std::uint8_t>(memory_size);
+    std::uint32_t m_memory_size = memory_size;
+    // the last ROM loaded, reset() puts it back into freshly cleared memory; only
+    // one read from a file is owned, in m_rom_file
+    utils::span<const std::uint8_t> m_rom;
+    std::vector<std::uint8_t> m_rom_file;
+    // multilinear hashes: the sum of every framebuffer word and every 8 byte memory word
+    // times a key for its position, so a write only has to add key * (new - old)
+    std::uint64_t m_framebuffer_hash = 0;
+    std::uint64_t m_memory_hash = 0;
+    // one cache slot per even address, odd addresses are decoded on the fly
+    std::vector<Instruction> decoded;
+
+    FaultInfo m_fault;
+    // StopOn bits raised by the instructions of the current run
+    std::uint8_t m_events = 0;
+    Engine m_engine = Engine::interpreter;
+    Quirks m_quirks = Quirks::chip8;
+    std::unique_ptr<BlockCache> blocks;
+    NativeFn m_native = nullptr;
+#ifdef CHIP8_PROFILING
+    Profiler* m_profiler = nullptr;
+#endif
 };
 
 class InterpreterException
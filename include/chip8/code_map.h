@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "utils/span.h"
+
+/**
+ * Static control flow analysis of a program in memory. Starting at the entry
+ * point it follows jumps, calls and both ways out of every skip, which yields
+ * the addresses holding code, the basic blocks with their successors and the
+ * call graph. BNNN jumps can't be followed without running the program, their
+ * targets stay unknown; so does code that is only reached by writing it first.
+ */
+class CodeMap
+{
+public:
+    enum class Byte : std::uint8_t
+    {
+        unknown,    // never reached, usually data
+        code,       // first byte of an instruction
+        operand     // rest of an instruction
+    };
+
+    struct Block
+    {
+        std::uint16_t start;
+        // one past the last instruction
+        std::uint16_t end;
+        // where control goes on, the callee of a 2NNN isn't one of them
+        std::vector<std::uint16_t> successors;
+        std::optional<std::uint16_t> callee;
+        // ends in a BNNN, whose targets are unknown
+        bool indirect = false;
+    };
+
+    struct CallEdge
+    {
+        // entry of the calling subroutine, or of the program
+        std::uint16_t caller;
+        std::uint16_t callee;
+    };
+
+    static constexpr std::uint16_t entry_point = 0x200;
+
+    CodeMap(utils::span<const std::uint8_t> memory, Chip8Cpu::Quirks quirks, std::uint16_t entry = entry_point);
+    // the program loaded into the machine, decoded with its quirks
+    explicit CodeMap(const Chip8Cpu& chip8);
+
+    Byte at(std::uint16_t addr) const noexcept
+    {
+        return addr < m_bytes.size() ? m_bytes[addr] : Byte::unknown;
+    }
+
+    // ordered by address
+    const std::vector<Block>& blocks() const noexcept
+    {
+        return m_blocks;
+    }
+
+    const Block* block_at(std::uint16_t start) const noexcept;
+
+    std::vector<std::uint16_t> block_starts() const;
+
+    // call targets, ordered by address
+    const std::vector<std::uint16_t>& subroutines() const noexcept
+    {
+        return m_subroutines;
+    }
+
+    const std::vector<CallEdge>& call_edges() const noexcept
+    {
+        return m_calls;
+    }
+
+    // addresses loaded into I by ANNN and F000, mostly sprites and tables
+    const std::vector<std::uint16_t>& data_refs() const noexcept
+    {
+        return m_data_refs;
+    }
+
+    // the whole memory from the entry point on: labelled instructions, unreached bytes as data
+    void write_listing(std::ostream& out) const;
+
+    // the instruction as assembly, next is the word after it, the operand of F000
+    static std::string disassemble(std::uint16_t opcode, Chip8Cpu::Quirks quirks, std::uint16_t next = 0);
+
+private:
+    std::uint16_t opcode_at(std::uint32_t addr) const noexcept;
+    std::uint32_t length_at(std::uint32_t addr) const noexcept;
+
+    std::vector<std::uint8_t> m_memory;
+    Chip8Cpu::Quirks m_quirks;
+    std::uint16_t m_entry;
+    std::vector<Byte> m_bytes;
+    std::vector<Block> m_blocks;
+    std::vector<std::uint16_t> m_subroutines;
+    std::vector<CallEdge> m_calls;
+    std::vector<std::uint16_t> m_data_refs;
+};
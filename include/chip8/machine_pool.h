@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <thread>
+
+#include "chip8.h"
+
+/**
+ * Owns many independent machines and advances them frame by frame on all cores.
+ * Machines are handed out in slices of a few frames, idle workers steal slices
+ * from busy ones. A machine is only ever stepped by one thread at a time and its
+ * state depends on nothing but itself, so results don't depend on the thread count
+ * as long as every machine has been given its own seed.
+ */
+class MachinePool
+{
+public:
+    struct Status
+    {
+        std::uint64_t frames = 0;
+        bool faulted = false;
+        // call Chip8Cpu::throw_fault() on the machine for a readable message
+        Chip8Cpu::FaultInfo fault;
+    };
+
+    explicit MachinePool(unsigned threads = std::thread::hardware_concurrency());
+
+    std::size_t add(Chip8Cpu&& machine);
+
+    Chip8Cpu& machine(std::size_t index)
+    {
+        return m_machines[index];
+    }
+
+    const Status& status(std::size_t index) const
+    {
+        return m_status[index];
+    }
+
+    std::size_t size() const noexcept
+    {
+        return m_machines.size();
+    }
+
+    // runs every machine that hasn't faulted for the given number of frames,
+    // ticking its timers after each frame's worth of instructions
+    void run(std::uint64_t frames, std::uint64_t cycles_per_frame, std::uint64_t frames_per_slice = 8);
+
+private:
+    unsigned m_threads;
+    std::deque<Chip8Cpu> m_machines;
+    std::deque<Status> m_status;
+};
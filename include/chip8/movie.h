@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "chip8.h"
+#include "scheduler.h"
+
+/**
+ * A recorded session: the seed, the instruction rate, the quirks and every key change,
+ * which together reproduce a run from a freshly loaded ROM bit for bit.
+ * Events are keyed by instruction count, so replays don't depend on host timing.
+ */
+struct Movie
+{
+    std::uint32_t seed = 0;
+    std::uint32_t rate = Scheduler::default_rate;
+    std::uint64_t rom_hash = 0;
+    Chip8Cpu::Quirks quirks = Chip8Cpu::Quirks::chip8;
+    // instruction count at which recording stopped, 0 if it never finished cleanly
+    std::uint64_t length = 0;
+    std::vector<KeyEvent> events;
+
+    static Movie load(const std::filesystem::path& path);
+};
+
+// content_hash() of the ROM file, stored in movies to catch replays against the wrong ROM
+std::uint64_t rom_hash(const std::filesystem::path& path);
+
+/**
+ * Writes a movie while it is being recorded. The header goes out first and
+ * each event is appended as it happens, so an interrupted recording is still
+ * readable up to the last flush.
+ */
+class MovieRecorder
+{
+public:
+    MovieRecorder(const std::filesystem::path& path, std::uint32_t seed, std::uint32_t rate, Chip8Cpu::Quirks quirks, std::uint64_t rom_hash);
+    ~MovieRecorder();
+    MovieRecorder(const MovieRecorder&) = delete;
+    void operator =(const MovieRecorder&) = delete;
+
+    // events have to be recorded in order
+    void record(const KeyEvent& event);
+
+    // marks the end of the recording, nothing can be recorded after that
+    void finish(std::uint64_t cycle);
+
+private:
+    void write_delta(std::uint64_t cycle);
+
+    std::ofstream m_out;
+    std::uint64_t m_last = 0;
+    bool m_finished = false;
+};
+
+// feeds a movie's key events into the machine a scheduler drives
+class MoviePlayer
+{
+public:
+    MoviePlayer(Scheduler& scheduler, std::vector<KeyEvent> events);
+
+    // runs up to the given total instruction count, applying key events on the way
+    void run(std::uint64_t total);
+
+    // true once every event has been applied
+    bool finished() const noexcept
+    {
+        return m_next == m_events.size();
+    }
+
+private:
+    Scheduler& m_scheduler;
+    std::vector<KeyEvent> m_events;
+    std::size_t m_next = 0;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "chip8.h"
+#include "utils/span.h"
+
+/**
+ * What ROMs translated to C++ by chip8_aot run on. The generated code keeps the
+ * registers in the machine and does the arithmetic itself, everything else goes
+ * through the interpreter's handlers one instruction at a time, and so does code
+ * that wasn't translated or no longer holds the bytes it was translated from.
+ */
+struct Chip8Cpu::Native
+{
+    Native(Chip8Cpu& cpu, std::uint8_t mask) noexcept
+        : cpu(cpu), V(cpu.V), I(cpu.I), pc(cpu.pc), delay_timer(cpu.delay_timer), sound_timer(cpu.sound_timer), mask(mask)
+    {
+    }
+
+    Chip8Cpu& cpu;
+    std::uint8_t* const V;
+    std::uint16_t& I;
+    // only up to date when control leaves translated code
+    std::uint16_t& pc;
+    std::uint8_t& delay_timer;
+    std::uint8_t& sound_timer;
+    // StopOn bits that end the run, faults included
+    const std::uint8_t mask;
+
+    std::uint8_t random_byte() noexcept
+    {
+        return cpu.rng.byte();
+    }
+
+    // whether memory still holds the code a block was translated from
+    bool unchanged(std::uint16_t addr, const std::uint8_t* code, std::uint16_t size) const noexcept
+    {
+        return addr + std::uint32_t{size} <= cpu.m_memory_size && std::memcmp(cpu.memory.data() + addr, code, size) == 0;
+    }
+
+    // runs the instruction at addr through the interpreter, false if it raised an event to stop on
+    bool interpret(std::uint16_t addr) noexcept
+    {
+        pc = addr;
+        cpu.execute((addr & 1) ? decode(cpu.fetch(addr), cpu.m_quirks) : cpu.decoded[addr >> 1]);
+        return !(cpu.m_events & mask);
+    }
+
+    // the instruction at pc, for code that wasn't translated
+    bool step() noexcept
+    {
+        if (pc >= cpu.m_memory_size - 1) {
+            cpu.m_fault = {Fault::pc_out_of_range, pc, 0};
+            cpu.m_events |= stop_on_fault;
+            return false;
+        }
+        return interpret(pc);
+    }
+
+    // 2NNN and 00EE, false after the interpreter raised a stack fault
+    bool call(std::uint16_t addr, std::uint16_t target) noexcept
+    {
+        if (cpu.sp == stack_size) {
+            return interpret(addr);
+        }
+        cpu.stack[cpu.sp++] = addr;
+        pc = target;
+        return true;
+    }
+
+    bool ret(std::uint16_t addr) noexcept
+    {
+        if (cpu.sp == 0) {
+            return interpret(addr);
+        }
+        pc = static_cast<std::uint16_t>(cpu.stack[--cpu.sp] + 2);
+        return true;
+    }
+
+    // the result of a run whose instruction number done raised an event, a fault doesn't count
+    RunResult stop(std::uint64_t done) const noexcept
+    {
+        return finish(done + !(cpu.m_events & stop_on_fault));
+    }
+
+    RunResult finish(std::uint64_t done) const noexcept
+    {
+        return {done, cpu.m_fault.fault, stop_reason(cpu.m_events & mask)};
+    }
+};
+
+// a translated ROM, the unit chip8_aot generates
+struct NativeProgram
+{
+    const char* name;
+    Chip8Cpu::Quirks quirks;
+    utils::span<const std::uint8_t> rom;
+    Chip8Cpu::NativeFn run;
+
+    // sets the machine up to run the program natively
+    void load(Chip8Cpu& chip8) const
+    {
+        chip8.set_quirks(quirks);
+        chip8.load_rom(rom);
+        chip8.attach_native(run);
+        chip8.set_engine(Chip8Cpu::Engine::native);
+    }
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "chip8.h"
+
+/**
+ * Collects an execution profile of the machines it is attached to: how often
+ * each operation and each address ran, the host time spent in DXYN and the
+ * FX handlers, and a call tree built from 2NNN and 00EE.
+ * Attaching is only possible in builds with CHIP8_PROFILING defined, otherwise
+ * the interpreter contains no trace of it.
+ */
+class Profiler
+{
+public:
+    using Operation = Chip8Cpu::Operation;
+
+    struct CallEdge
+    {
+        std::uint16_t caller;
+        std::uint16_t callee;
+        std::uint64_t count;
+    };
+
+    Profiler();
+
+    void reset();
+
+    std::uint64_t instructions() const noexcept
+    {
+        return m_instructions;
+    }
+
+    std::uint64_t count(Operation op) const noexcept
+    {
+        return m_op_counts[static_cast<std::size_t>(op)];
+    }
+
+    std::uint64_t count_at(std::uint16_t addr) const noexcept
+    {
+        return m_pc_counts[addr];
+    }
+
+    // only DXYN and the FX operations are timed, everything else reports zero
+    std::chrono::nanoseconds time(Operation op) const noexcept
+    {
+        return m_op_times[static_cast<std::size_t>(op)];
+    }
+
+    std::vector<CallEdge> call_edges() const;
+
+    // operations, the hottest addresses and the call edges as plain text tables
+    void write_flat(std::ostream& out, std::size_t top_addresses = 20) const;
+
+    // one "frame;frame;... count" line per call stack, the input format of flamegraph.pl
+    void write_folded(std::ostream& out) const;
+
+    static const char* name(Operation op);
+
+    // DXYN and the FX operations get their host time measured
+    static bool timed(Operation op) noexcept
+    {
+        return op == Operation::drw || op >= Operation::ld_i_long;
+    }
+
+private:
+    friend class Chip8Cpu;
+
+    // addr and op describe the instruction that just ran, completed is false if it faulted
+    void record(std::uint16_t addr, Operation op, std::uint16_t opcode, std::chrono::nanoseconds elapsed, bool completed);
+
+    // call tree node, one per distinct call stack; node 0 is the program entry
+    struct Frame
+    {
+        std::uint16_t addr;
+        std::uint32_t parent;
+        std::uint64_t self = 0;
+        std::vector<std::pair<std::uint16_t, std::uint32_t>> children;
+    };
+
+    std::uint64_t m_instructions = 0;
+    std::array<std::uint64_t, static_cast<std::size_t>(Operation::count)> m_op_counts{};
+    std::array<std::chrono::nanoseconds, static_cast<std::size_t>(Operation::count)> m_op_times{};
+    std::array<std::uint64_t, Chip8Cpu::max_memory_size> m_pc_counts{};
+
+    std::vector<Frame> m_frames;
+    std::uint32_t m_current = 0;
+    std::map<std::pair<std::uint16_t, std::uint16_t>, std::uint64_t> m_edges;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "chip8.h"
+
+/**
+ * Keeps a bounded history of saved states for stepping backwards in time.
+ * Only the newest state is stored in full, every older one is kept as the
+ * run-length encoded XOR difference to its successor. When the memory budget
+ * is exceeded the oldest differences are dropped first.
+ */
+class RewindBuffer
+{
+public:
+    explicit RewindBuffer(std::size_t capacity_bytes);
+
+    // records the current state of the machine, typically once per frame
+    void push(const Chip8Cpu& chip8);
+
+    // loads the state recorded before the newest one, returns false if there is none
+    bool rewind(Chip8Cpu& chip8);
+
+    void clear();
+
+    std::size_t size() const noexcept
+    {
+        return m_deltas.size();
+    }
+
+    std::size_t memory_usage() const noexcept
+    {
+        return m_bytes + m_current.size();
+    }
+
+private:
+    std::size_t m_capacity;
+    std::size_t m_bytes = 0;
+    std::vector<std::uint8_t> m_current;
+    std::deque<std::vector<std::uint8_t>> m_deltas;
+};
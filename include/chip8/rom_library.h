@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "utils/mapped_file.h"
+#include "utils/span.h"
+
+// FNV-1a of a ROM image, the same value movies store to identify their ROM
+std::uint64_t content_hash(utils::span<const std::uint8_t> data);
+
+/**
+ * A set of ROMs kept memory mapped for repeated loading, from a directory tree,
+ * a single ROM file or an archive written by pack(). ROMs are indexed by name
+ * and by content hash, and their data points straight into the mapping, so
+ * handing one to Chip8Cpu::load_rom() copies it once and touches no files.
+ */
+class RomLibrary
+{
+public:
+    struct Rom
+    {
+        // path relative to the opened directory, the file name or the name stored in the archive
+        std::string name;
+        std::uint64_t hash;
+        utils::span<const std::uint8_t> data;
+    };
+
+    explicit RomLibrary(const std::filesystem::path& path);
+    RomLibrary(RomLibrary&&) noexcept = default;
+    RomLibrary& operator =(RomLibrary&&) noexcept = default;
+
+    const std::vector<Rom>& roms() const noexcept
+    {
+        return m_roms;
+    }
+
+    // nullptr if there is no such ROM; identical ROMs under several names are found by the first one
+    const Rom* find(std::uint64_t hash) const;
+    const Rom* find(std::string_view name) const;
+
+    // writes every file below a directory into one archive, which maps with a single call
+    static void pack(const std::filesystem::path& directory, const std::filesystem::path& archive);
+
+    static bool is_archive(utils::span<const std::uint8_t> data);
+
+private:
+    void add(std::string name, std::uint64_t hash, utils::span<const std::uint8_t> data);
+    void open_archive(utils::span<const std::uint8_t> data, const std::filesystem::path& path);
+
+    std::vector<utils::MappedFile> m_files;
+    std::vector<Rom> m_roms;
+    std::unordered_map<std::uint64_t, std::size_t> m_by_hash;
+    std::unordered_map<std::string, std::size_t> m_by_name;
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include "chip8.h"
+#include "utils/span.h"
+
+class AudioStream;
+
+struct KeyEvent
+{
+    // instructions executed before the key changed
+    std::uint64_t cycle;
+    std::uint8_t key;
+    bool down;
+};
+
+/**
+ * Paces a machine independently of how often the frontend calls in.
+ * The instruction rate defines emulated time: the 60 Hz timers tick after
+ * exactly rate / 60 instructions on average, no matter how fast the host
+ * actually executes them. In unlimited mode host time only bounds how long
+ * a single advance() call may keep emulating.
+ */
+class Scheduler
+{
+public:
+    static constexpr unsigned timer_rate = 60;
+    static constexpr unsigned default_rate = 700;
+
+    explicit Scheduler(Chip8Cpu& chip8, unsigned rate = default_rate, bool unlimited = false);
+
+    void set_rate(unsigned rate, bool unlimited = false);
+
+    unsigned rate() const noexcept
+    {
+        return m_rate;
+    }
+
+    bool unlimited() const noexcept
+    {
+        return m_unlimited;
+    }
+
+    // catches up with the given amount of host time, returns the executed instruction count
+    std::uint64_t advance(std::chrono::nanoseconds elapsed);
+
+    // the instructions the given amount of host time is worth at the set rate; advance()
+    // without running them, for callers that need to know the count up front
+    std::uint64_t cycles_due(std::chrono::nanoseconds elapsed);
+
+    // runs exactly the given number of instructions and ticks the timers on the way
+    std::uint64_t run_cycles(std::uint64_t cycles);
+
+    // run_cycles() that changes the keys right before the instruction each event names;
+    // events have to be ordered by cycle, returns how many of them were applied
+    std::size_t run_events(std::uint64_t cycles, utils::span<const KeyEvent> events);
+
+    std::uint64_t cycles() const noexcept
+    {
+        return m_cycles;
+    }
+
+    void reset();
+
+    // the stream gets every timer tick's worth of sound, nullptr turns audio off
+    void set_audio(AudioStream* audio) noexcept
+    {
+        m_audio = audio;
+    }
+
+private:
+    Chip8Cpu& m_chip8;
+    unsigned m_rate;
+    bool m_unlimited;
+    AudioStream* m_audio = nullptr;
+
+    std::uint64_t m_cycles = 0;
+    // host time owed to the machine, in units of 1/rate ns to avoid rounding drift
+    std::uint64_t m_pending = 0;
+    // grows by timer_rate per instruction, a timer tick is due each time it reaches m_rate
+    std::uint64_t m_timer_phase = 0;
+};
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "chip8.h"
+#include "utils/span.h"
+
+/**
+ * Translates a ROM ahead of time into C++ for the native engine, see native.h.
+ * Every basic block the CodeMap reaches inside the ROM becomes a case of one
+ * switch over the program counter, with direct jumps between them. Whatever the
+ * analysis can't see, BNNN targets unless they're passed as further entry points
+ * and code the program writes itself, runs on the interpreter.
+ */
+class Translator
+{
+public:
+    Translator(utils::span<const std::uint8_t> rom, Chip8Cpu::Quirks quirks, utils::span<const std::uint16_t> entries = {});
+
+    // where the BNNN jumps of the ROM went within its first frames on the interpreter, without input
+    static std::vector<std::uint16_t> trace_jumps(utils::span<const std::uint8_t> rom, Chip8Cpu::Quirks quirks, std::uint64_t frames);
+
+    // a source file defining `extern const NativeProgram <symbol>` named after the ROM
+    void write(std::ostream& out, const std::string& symbol, const std::string& name) const;
+
+    std::size_t blocks() const noexcept
+    {
+        return m_segments.size();
+    }
+
+    std::size_t instructions() const noexcept;
+
+private:
+    struct Segment
+    {
+        std::uint16_t start;
+        // one past the last instruction
+        std::uint16_t end;
+        std::vector<std::uint16_t> instructions;
+    };
+
+    std::uint16_t opcode_at(std::uint32_t addr) const noexcept;
+    std::uint32_t length_at(std::uint32_t addr) const noexcept;
+    bool is_translated(std::uint32_t addr) const noexcept;
+    // where a skip at addr lands when it skips
+    std::uint32_t skip_target(std::uint32_t addr) const noexcept;
+
+    std::vector<std::uint8_t> m_rom;
+    std::vector<std::uint8_t> m_memory;
+    Chip8Cpu::Quirks m_quirks;
+    std::vector<Segment> m_segments;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+#include "span.h"
+
+namespace utils
+{
+
+// read-only memory mapping of a whole file, empty files map to an empty span
+class MappedFile
+{
+public:
+    MappedFile() noexcept = default;
+    explicit MappedFile(const std::filesystem::path& path);
+    ~MappedFile();
+
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator =(MappedFile&& other) noexcept;
+    MappedFile(const MappedFile&) = delete;
+    void operator =(const MappedFile&) = delete;
+
+    span<const std::uint8_t> bytes() const noexcept
+    {
+        return {m_data, m_size};
+    }
+
+private:
+    void unmap() noexcept;
+
+    const std::uint8_t* m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+}
@@ -1,35 +1,93 @@
 #pragma once
 
-#include <chrono>
-#include <limits>
-#include <random>
+#include <array>
+#include <cstddef>
+#include <cstdint>
 
 namespace utils
 {
 
-template <class Int = int>
+// xoshiro128++: 128 bits of state, a few cycles per number and good enough for games.
+// The same seed always produces the same sequence, on every platform
 class Random
 {
 public:
-    Random()
-        : m_gen(std::mt19937::result_type(std::chrono::system_clock::now().time_since_epoch().count())),
-        m_dist(std::numeric_limits<Int>::min(), std::numeric_limits<Int>::max()) {}
+    using State = std::array<std::uint32_t, 4>;
 
-    Int operator ()()
+    Random() noexcept
+        : Random(0) {}
+
+    explicit Random(std::uint64_t seed) noexcept
+    {
+        // splitmix64 spreads the seed over the whole state, which must not be all zero
+        for (std::size_t i = 0; i < m_state.size(); i += 2) {
+            seed += 0x9E3779B97F4A7C15;
+            auto z = seed;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+            z ^= z >> 31;
+            m_state[i] = static_cast<std::uint32_t>(z);
+            m_state[i + 1] = static_cast<std::uint32_t>(z >> 32);
+        }
+    }
+
+    std::uint32_t operator ()() noexcept
+    {
+        auto& s = m_state;
+        const auto result = rotl(s[0] + s[3], 7) + s[0];
+        const auto t = s[1] << 9;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 11);
+        return result;
+    }
+
+    // the high bits are the best ones
+    std::uint8_t byte() noexcept
+    {
+        return static_cast<std::uint8_t>((*this)() >> 24);
+    }
+
+    // bulk bytes for inputs that don't have to match a machine, e.g. fuzzer data: four bytes
+    // per step, so not the sequence repeated byte() calls, and thus CXNN, would give
+    void fill(std::uint8_t* out, std::size_t size) noexcept
+    {
+        std::size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            const auto v = (*this)();
+            out[i] = static_cast<std::uint8_t>(v >> 24);
+            out[i + 1] = static_cast<std::uint8_t>(v >> 16);
+            out[i + 2] = static_cast<std::uint8_t>(v >> 8);
+            out[i + 3] = static_cast<std::uint8_t>(v);
+        }
+        if (i < size) {
+            auto v = (*this)();
+            for (; i < size; i++, v <<= 8) {
+                out[i] = static_cast<std::uint8_t>(v >> 24);
+            }
+        }
+    }
+
+    const State& state() const noexcept
+    {
+        return m_state;
+    }
+
+    void set_state(const State& state) noexcept
     {
-        return m_dist(m_gen);
+        m_state = state;
     }
 
 private:
-    std::mt19937 m_gen;
-    std::uniform_int_distribution<Int> m_dist;
-};
+    static constexpr std::uint32_t rotl(std::uint32_t x, int k) noexcept
+    {
+        return (x << k) | (x >> (32 - k));
+    }
 
-template <class Int = int>
-Int random()
-{
-    thread_local Random<Int> r;
-    return r();
-}
+    State m_state{};
+};
 
 }
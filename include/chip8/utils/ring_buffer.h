@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+namespace utils
+{
+
+// Fixed size queue between exactly one producer thread and one consumer thread.
+// Neither side locks or waits: write() takes what fits and read() returns what is there
+template <class T>
+class RingBuffer
+{
+public:
+    // the capacity gets rounded up to a power of two
+    explicit RingBuffer(std::size_t capacity)
+    {
+        std::size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        m_data.resize(size);
+        m_mask = size - 1;
+    }
+
+    RingBuffer(const RingBuffer&) = delete;
+    void operator =(const RingBuffer&) = delete;
+
+    std::size_t capacity() const noexcept
+    {
+        return m_data.size();
+    }
+
+    // elements waiting to be read, exact only on the consumer side
+    std::size_t size() const noexcept
+    {
+        return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+    }
+
+    // producer: appends as many elements as fit and returns their count
+    std::size_t write(const T* data, std::size_t count) noexcept
+    {
+        const auto head = m_head.load(std::memory_order_relaxed);
+        const auto tail = m_tail.load(std::memory_order_acquire);
+        count = std::min(count, capacity() - (head - tail));
+        for (std::size_t i = 0; i < count; i++) {
+            m_data[(head + i) & m_mask] = data[i];
+        }
+        m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    bool push(const T& value) noexcept
+    {
+        return write(&value, 1) == 1;
+    }
+
+    // consumer: takes up to count elements and returns how many there were
+    std::size_t read(T* out, std::size_t count) noexcept
+    {
+        const auto tail = m_tail.load(std::memory_order_relaxed);
+        const auto head = m_head.load(std::memory_order_acquire);
+        count = std::min(count, head - tail);
+        for (std::size_t i = 0; i < count; i++) {
+            out[i] = m_data[(tail + i) & m_mask];
+        }
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    bool pop(T& value) noexcept
+    {
+        return read(&value, 1) == 1;
+    }
+
+private:
+    std::vector<T> m_data;
+    std::size_t m_mask;
+    // both only ever grow, the difference is the fill level; kept apart so the
+    // two threads don't fight over one cache line
+    alignas(64) std::atomic<std::size_t> m_head{0};
+    alignas(64) std::atomic<std::size_t> m_tail{0};
+};
+
+}
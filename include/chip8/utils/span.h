@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace utils
+{
+
+// non-owning view on contiguous memory until the project can rely on C++20's std::span
+template <class T>
+class span
+{
+public:
+    constexpr span() noexcept = default;
+
+    constexpr span(T* data, std::size_t size) noexcept
+        : m_data(data), m_size(size) {}
+
+    template <class Container, class = std::enable_if_t<
+        std::is_convertible_v<decltype(std::declval<Container&>().data()), T*>>>
+    constexpr span(Container& c) noexcept
+        : m_data(c.data()), m_size(c.size()) {}
+
+    constexpr T* data() const noexcept
+    {
+        return m_data;
+    }
+
+    constexpr std::size_t size() const noexcept
+    {
+        return m_size;
+    }
+
+    constexpr bool empty() const noexcept
+    {
+        return m_size == 0;
+    }
+
+    constexpr T* begin() const noexcept
+    {
+        return m_data;
+    }
+
+    constexpr T* end() const noexcept
+    {
+        return m_data + m_size;
+    }
+
+    constexpr T& operator [](std::size_t i) const noexcept
+    {
+        return m_data[i];
+    }
+
+private:
+    T* m_data = nullptr;
+    std::size_t m_size = 0;
+};
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace utils
+{
+
+// Hands the newest value from one producer thread to one consumer thread without
+// either side ever waiting. The producer fills back() and publish()es it, the
+// consumer calls update() and reads front(); values nobody picked up get overwritten
+template <class T>
+class TripleBuffer
+{
+public:
+    T& back() noexcept
+    {
+        return m_buffers[m_back];
+    }
+
+    // swaps the filled back buffer with the spare one
+    void publish() noexcept
+    {
+        const auto spare = m_spare.exchange(static_cast<std::uint8_t>(m_back | fresh), std::memory_order_acq_rel);
+        m_back = spare & index_mask;
+    }
+
+    // makes the latest published value the front, returns false if nothing new arrived since the last call
+    bool update() noexcept
+    {
+        if (!(m_spare.load(std::memory_order_relaxed) & fresh)) {
+            return false;
+        }
+        const auto spare = m_spare.exchange(m_front, std::memory_order_acq_rel);
+        m_front = spare & index_mask;
+        return true;
+    }
+
+    const T& front() const noexcept
+    {
+        return m_buffers[m_front];
+    }
+
+private:
+    static constexpr std::uint8_t index_mask = 3;
+    static constexpr std::uint8_t fresh = 4;
+
+    T m_buffers[3]{};
+    // only touched by the producer
+    std::uint8_t m_back = 0;
+    // index of the buffer in between, plus the fresh bit while the consumer hasn't taken it
+    std::atomic<std::uint8_t> m_spare{1};
+    // only touched by the consumer
+    std::uint8_t m_front = 2;
+};
+
+}
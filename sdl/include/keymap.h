@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include <SDL.h>
+#include <chip8/chip8.h>
+
+// which host key stands for which of the 16 Chip-8 keys
+class Keymap
+{
+public:
+    // the host key for each Chip-8 key from 0 to F: the hex pad laid over
+    // 1 2 3 4 / q w e r / a s d f / y x c v on a QWERTZ keyboard
+    static constexpr std::string_view default_layout = "x123qweasdyc4rfv";
+
+    Keymap() noexcept
+        : Keymap(default_layout) {}
+
+    // nullopt unless the layout names 16 different lower case letters or digits
+    static std::optional<Keymap> parse(std::string_view layout)
+    {
+        if (layout.size() != Chip8Cpu::keys_size) {
+            return std::nullopt;
+        }
+        std::array<bool, 128> used{};
+        for (auto c : layout) {
+            const bool valid = (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9');
+            if (!valid || used[static_cast<unsigned char>(c)]) {
+                return std::nullopt;
+            }
+            used[static_cast<unsigned char>(c)] = true;
+        }
+        return Keymap{layout};
+    }
+
+    // the Chip-8 key a host key code stands for, -1 if none
+    int operator [](SDL_Keycode key) const noexcept
+    {
+        return key >= 0 && static_cast<std::size_t>(key) < m_chip8_keys.size() ? m_chip8_keys[key] : -1;
+    }
+
+private:
+    explicit Keymap(std::string_view layout) noexcept
+    {
+        m_chip8_keys.fill(-1);
+        for (std::size_t k = 0; k < layout.size(); k++) {
+            // SDL key codes of letters and digits are their ASCII codes
+            m_chip8_keys[static_cast<unsigned char>(layout[k])] = static_cast<std::int8_t>(k);
+        }
+    }
+
+    std::array<std::int8_t, 128> m_chip8_keys{};
+};
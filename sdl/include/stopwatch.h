@@ -1,27 +1,34 @@
 #pragma once
 
-#include <SDL_timer.h>
+#include <chrono>
 
 class StopWatch
 {
 public:
+    using clock = std::chrono::steady_clock;
+
     StopWatch() = default;
 
-    Uint32 elapsed_ms() const
+    clock::duration elapsed() const
     {
-        return get_ticks() - m_current_ticks;
+        return clock::now() - m_start;
     }
 
-    void update()
+    // when the current lap started
+    clock::time_point started() const
     {
-        m_current_ticks = get_ticks();
+        return m_start;
     }
 
-    static Uint32 get_ticks()
+    // returns the time since the last lap and starts a new one
+    clock::duration lap()
     {
-        return SDL_GetTicks();
+        const auto now = clock::now();
+        const auto d = now - m_start;
+        m_start = now;
+        return d;
     }
 
 private:
-    Uint32 m_current_ticks = get_ticks();
+    clock::time_point m_start = clock::now();
 };
@@ -1,8 +1,30 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <chip8/audio.h>
 #include <chip8/chip8.h>
+#include <chip8/movie.h>
+#include <chip8/rewind_buffer.h>
+#include <chip8/scheduler.h>
+#include <chip8/utils/ring_buffer.h>
+#include <chip8/utils/triple_buffer.h>
+#include "keymap.h"
 #include "sdlpp.h"
 
+/**
+ * Emulation runs on a thread of its own and publishes every changed frame, the
+ * thread calling run() only handles input and presents the newest frame. Neither
+ * waits for the other, so vsync can't slow the emulation down and a slow frame
+ * can't stall the display
+ */
 class Window
 {
 public:
@@ -13,16 +35,112 @@ public:
 
     void run();
 
+    // instructions per second, unlimited runs as many as fit in each host frame
+    void set_speed(unsigned rate, bool unlimited);
+
+    // records every following run() to a movie file, rewinding is disabled meanwhile
+    void record(const std::filesystem::path& movie, std::uint64_t rom_hash);
+
+    // replays the movie as fast as possible in the next run(), then hands over to the keyboard
+    void replay(Movie movie);
+
+    void set_keymap(const Keymap& keymap)
+    {
+        m_keymap = keymap;
+    }
+
 private:
+    using clock = std::chrono::steady_clock;
+
+    // a key change as the render side saw it, stamped with host time
+    struct InputEvent
+    {
+        clock::time_point time;
+        std::uint8_t key;
+        bool down;
+    };
+
+    // the display planes as the emulation thread hands them over
+    struct Frame
+    {
+        bool hires = false;
+        std::uint64_t gfx[Chip8Cpu::planes][Chip8Cpu::hires_height][Chip8Cpu::row_words] = {};
+
+        int width() const noexcept
+        {
+            return hires ? Chip8Cpu::hires_width : Chip8Cpu::lores_width;
+        }
+
+        int height() const noexcept
+        {
+            return hires ? Chip8Cpu::hires_height : Chip8Cpu::lores_height;
+        }
+    };
+
     Chip8Cpu& m_chip8;
     sdl::Window m_window;
     sdl::Renderer m_renderer;
     sdl::Texture m_canvas;
+    int m_canvas_width{};
+    int m_canvas_height{};
+    RewindBuffer m_rewind;
+    Scheduler m_scheduler;
+    // filled by the emulation thread, drained by the audio callback; 0 if there's no sound
+    AudioStream m_audio;
+    SDL_AudioDeviceID m_audio_device{};
+
+    // body of the emulation thread, runs until m_done is set
+    void emulate();
+    // joins the emulation thread once m_done is set and undoes what a replay changed
+    void finish_run(std::thread& emulation);
+    // copies the display into the back frame and hands it to the render side
+    void publish();
+
+    // uploads the rows that differ from the last frame shown and presents
+    void render(const Frame& frame);
+
+    // render side: queues a host key change if the keymap knows the key
+    void queue_key(SDL_Keycode key, bool down);
+    // emulation thread: turns the input queued up to now into key events for the slice of
+    // host time that started at start and lasted elapsed, spread over its cycles
+    void take_input(clock::time_point start, clock::duration elapsed, std::uint64_t cycles);
+    // emulation thread: sets the machine's keys to the ones held on the host
+    void sync_keys();
+
+    // runs the replay for one host frame and ends it once the movie is over
+    void replay_slice();
+
+    std::atomic<bool> m_done{};
+    std::atomic<bool> m_rewinding{};
+    Keymap m_keymap;
+    utils::RingBuffer<InputEvent> m_input;
+    // written by the render side only: the keys held on the host, and whether an event didn't
+    // fit into m_input, in which case the emulation thread catches up from the mask instead
+    std::atomic<std::uint16_t> m_host_keys{};
+    std::atomic<bool> m_input_lost{};
+    // emulation thread only: bit k is set while key k is held down, and the events of the current slice
+    std::uint16_t m_held{};
+    std::vector<KeyEvent> m_key_events;
+    // whatever ended the emulation thread early, rethrown by run()
+    std::exception_ptr m_error;
+    utils::TripleBuffer<Frame> m_frames;
+
+    // render side only: what the canvas holds, and whether the window contents got
+    // lost, e.g. after being uncovered or going fullscreen
+    Frame m_shown;
+    bool m_redraw{};
 
-    void render();
+    std::filesystem::path m_record_path;
+    std::uint64_t m_record_rom{};
+    std::optional<MovieRecorder> m_recorder;
 
-    void key_press(int key);
-    void key_release(int key);
+    std::optional<Movie> m_movie;
+    std::optional<MoviePlayer> m_player;
+    std::uint64_t m_replay_end{};
+    // the settings a replay overrides, put back when it ends and when run() returns
+    unsigned m_rate{};
+    bool m_unlimited{};
+    Chip8Cpu::Quirks m_quirks{};
 
-    bool m_done{};
+    std::vector<Uint32> m_pixels;
 };
@@ -1,6 +1,7 @@
 #include <array>
 #include <exception>
 #include <filesystem>
+#include <optional>
 #include <string>
 
 #include <fmt/format.h>
@@ -9,6 +10,7 @@
 #include <tinyfiledialogs.h>
 
 #include <chip8/chip8.h>
+#include <chip8/movie.h>
 
 #include "window.h"
 
@@ -30,6 +32,12 @@ try {
     cxxopts::Options options{argv[0], "Allowed options"};
     options.add_options()
         ("p,path", "Path to the ROM file", cxxopts::value<std::string>())
+        ("r,rate", "Instructions per second", cxxopts::value<unsigned>()->default_value(std::to_string(Scheduler::default_rate)))
+        ("u,unlimited", "Run as many instructions as possible per frame")
+        ("q,quirks", fmt::format("Interpreter quirks ({})", Chip8Cpu::quirks_names()), cxxopts::value<std::string>()->default_value("chip8"))
+        ("record", "Record the session to a movie file", cxxopts::value<std::string>())
+        ("replay", "Replay a movie file as fast as possible before handing over the keyboard", cxxopts::value<std::string>())
+        ("k,keymap", "Host keys for the Chip-8 keys 0 to F", cxxopts::value<std::string>()->default_value(std::string{Keymap::default_layout}))
         ("h,help", "Print help")
     ;
 
@@ -51,12 +59,45 @@ try {
         dialog_based = true;
     }
 
+    // only the first ROM gets replayed
+    std::optional<Movie> movie;
+    if (opts.count("replay")) {
+        movie = Movie::load(opts["replay"].as<std::string>());
+    }
+
     Chip8Cpu chip8;
+    const auto quirks_name = opts["quirks"].as<std::string>();
+    const auto quirks = Chip8Cpu::parse_quirks(quirks_name);
+    if (!quirks) {
+        fmt::fprintf(stderr, "Error: unknown quirks \"%s\"\n", quirks_name);
+        return 1;
+    }
+    chip8.set_quirks(*quirks);
+
+    const auto keymap = Keymap::parse(opts["keymap"].as<std::string>());
+    if (!keymap) {
+        fmt::fprintf(stderr, "Error: a keymap needs 16 different letters or digits\n");
+        return 1;
+    }
+
     Window window{chip8, 640, 320};
+    window.set_speed(opts["rate"].as<unsigned>(), opts.count("unlimited") > 0);
+    window.set_keymap(*keymap);
 
     do {
         try {
             chip8.load_rom(path);
+            if (opts.count("record")) {
+                window.record(opts["record"].as<std::string>(), rom_hash(path));
+            }
+            if (movie) {
+                auto recorded = std::move(*movie);
+                movie.reset();
+                if (recorded.rom_hash != rom_hash(path)) {
+                    throw IOException("Movie was recorded with a different ROM");
+                }
+                window.replay(std::move(recorded));
+            }
             window.run();
         } catch (const Exception& e) {
             tinyfd_messageBox("Error", fmt::format("{}: {}", e.what(), e.message()).c_str(), "ok", "error", 1);
@@ -1,212 +1,427 @@
 #include "window.h"
 
+#include <random>
+#include <thread>
+
 #include "stopwatch.h"
 
+// enough for several minutes of history in typical games
+static constexpr std::size_t rewind_capacity = 16 * 1024 * 1024;
+
+// the emulation thread wakes up once per timer tick, as the display can't change more often
+static constexpr std::chrono::nanoseconds emulation_tick{1000000000 / Scheduler::timer_rate};
+
+// host time spent emulating per tick in unlimited mode
+static constexpr std::chrono::milliseconds unlimited_slice{10};
+
+// instructions replayed between two host clock checks
+static constexpr std::uint64_t replay_chunk = 10000;
+
+// key changes that can wait for the emulation thread, far more than anyone can type in a tick
+static constexpr std::size_t input_queue = 256;
+
+// longest the render side waits for input before looking for a new frame
+static constexpr int event_wait_ms = 1;
+
+// a short queue keeps the sound close to the picture, at the cost of a gap after a stall
+static constexpr std::size_t audio_queue = 2048;
+static constexpr Uint16 audio_device_buffer = 512;
+
+// RGBA colours of the four plane combinations: off, plane 0, plane 1, both
+static constexpr Uint32 palette[4] = {0x000000FF, 0xFFFFFFFF, 0xAAAAAAFF, 0x555555FF};
+
+// runs on SDL's audio thread, which must never block
+static void SDLCALL audio_callback(void* userdata, Uint8* stream, int len)
+{
+    static_cast<AudioStream*>(userdata)->read(reinterpret_cast<std::int16_t*>(stream), static_cast<std::size_t>(len) / sizeof(std::int16_t));
+}
+
 Window::Window(Chip8Cpu& chip8, int width, int height)
-    : m_chip8(chip8)
+    : m_chip8(chip8), m_rewind(rewind_capacity), m_scheduler(chip8), m_audio(AudioStream::default_sample_rate, audio_queue),
+      m_input(input_queue)
 {
     m_window = sdl::Window{sdl::call(SDL_CreateWindow, "Chip-8 Emulator", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_SHOWN)};
     m_renderer = sdl::Renderer{sdl::call(SDL_CreateRenderer, m_window.get(), -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)};
-    m_canvas = sdl::Texture{sdl::call(SDL_CreateTexture, m_renderer.get(), SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, Chip8Cpu::screen_width, Chip8Cpu::screen_height)};
+    m_pixels.resize(Chip8Cpu::hires_width * Chip8Cpu::hires_height);
+
+    // a machine without a sound device still runs, just silently
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) == 0) {
+        SDL_AudioSpec spec{};
+        spec.freq = static_cast<int>(m_audio.sample_rate());
+        spec.format = AUDIO_S16SYS;
+        spec.channels = 1;
+        spec.samples = audio_device_buffer;
+        spec.callback = audio_callback;
+        spec.userdata = &m_audio;
+        // SDL converts if the device wants something else
+        m_audio_device = SDL_OpenAudioDevice(nullptr, 0, &spec, nullptr, 0);
+        if (m_audio_device) {
+            m_scheduler.set_audio(&m_audio);
+        } else {
+            SDL_QuitSubSystem(SDL_INIT_AUDIO);
+        }
+    }
+}
+
+Window::~Window()
+{
+    if (m_audio_device) {
+        SDL_CloseAudioDevice(m_audio_device);
+        SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    }
+}
+
+void Window::set_speed(unsigned rate, bool unlimited)
+{
+    m_scheduler.set_rate(rate, unlimited);
 }
 
-Window::~Window() = default;
+void Window::record(const std::filesystem::path& movie, std::uint64_t rom_hash)
+{
+    m_record_path = movie;
+    m_record_rom = rom_hash;
+}
+
+void Window::replay(Movie movie)
+{
+    m_movie = std::move(movie);
+}
 
 void Window::run()
 {
     m_done = false;
+    m_rewinding = false;
+    m_error = nullptr;
+    // nobody consumes the input between runs, so what piled up since the last one is stale
+    for (InputEvent e; m_input.pop(e);) {
+    }
+    m_held = 0;
+    m_host_keys = 0;
+    m_input_lost = false;
     m_chip8.reset();
+    m_rewind.clear();
+    m_scheduler.reset();
+    m_redraw = true;
 
-    SDL_Event evt;
-    StopWatch watch;
-
-    while (!m_done) {
-        while (SDL_PollEvent(&evt)) {
-            switch (evt.type) {
-            case SDL_QUIT:
-                m_done = true;
-                break;
-            case SDL_KEYDOWN:
-                switch (evt.key.keysym.sym) {
-                case SDLK_q:
-                    if (evt.key.keysym.mod & KMOD_LCTRL) {
-                case SDLK_ESCAPE:
-                        m_done = true;
-                        break;
+    m_recorder.reset();
+    m_player.reset();
+    m_rate = m_scheduler.rate();
+    m_unlimited = m_scheduler.unlimited();
+    m_quirks = m_chip8.quirks();
+    if (m_movie) {
+        m_chip8.seed(m_movie->seed);
+        m_chip8.set_quirks(m_movie->quirks);
+        m_scheduler.set_rate(m_movie->rate);
+        m_replay_end = m_movie->length ? m_movie->length : (m_movie->events.empty() ? 0 : m_movie->events.back().cycle);
+        m_player.emplace(m_scheduler, std::move(m_movie->events));
+        m_movie.reset();
+    } else if (!m_record_path.empty()) {
+        const auto seed = std::random_device{}();
+        m_chip8.seed(seed);
+        m_recorder.emplace(m_record_path, seed, m_scheduler.rate(), m_chip8.quirks(), m_record_rom);
+    }
+
+    // from here on the machine, the scheduler, the movie and the rewind buffer
+    // belong to the emulation thread until it is joined
+    publish();
+    std::thread emulation{[this] { emulate(); }};
+    if (m_audio_device) {
+        SDL_PauseAudioDevice(m_audio_device, 0);
+    }
+
+    // an SDL error on this side must still stop and join the emulation thread
+    try {
+        SDL_Event evt;
+        while (!m_done) {
+            while (SDL_PollEvent(&evt)) {
+                switch (evt.type) {
+                case SDL_QUIT:
+                    m_done = true;
+                    break;
+                case SDL_WINDOWEVENT:
+                    // only these lose the window contents, focus and mouse changes don't
+                    if (evt.window.event == SDL_WINDOWEVENT_EXPOSED || evt.window.event == SDL_WINDOWEVENT_SIZE_CHANGED ||
+                        evt.window.event == SDL_WINDOWEVENT_RESIZED) {
+                        m_redraw = true;
                     }
-                case SDLK_RETURN:
-                case SDLK_KP_ENTER:
-                    if (evt.key.keysym.mod & KMOD_LALT) {
-                case SDLK_F11:
-                        auto flags = SDL_GetWindowFlags(m_window.get());
-                        auto set_fs = flags & SDL_WINDOW_FULLSCREEN_DESKTOP ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP;
-                        sdl::call(SDL_SetWindowFullscreen, m_window.get(), set_fs);
-                        int w, h;
-                        SDL_GetWindowSize(m_window.get(), &w, &h);
-                        sdl::call(SDL_RenderSetLogicalSize, m_renderer.get(), w, h);
+                    break;
+                case SDL_KEYDOWN:
+                    switch (evt.key.keysym.sym) {
+                    case SDLK_BACKSPACE:
+                        m_rewinding = true;
                         break;
+                    case SDLK_q:
+                        if (evt.key.keysym.mod & KMOD_LCTRL) {
+                    case SDLK_ESCAPE:
+                            m_done = true;
+                            break;
+                        }
+                    case SDLK_RETURN:
+                    case SDLK_KP_ENTER:
+                        if (evt.key.keysym.mod & KMOD_LALT) {
+                    case SDLK_F11:
+                            auto flags = SDL_GetWindowFlags(m_window.get());
+                            auto set_fs = flags & SDL_WINDOW_FULLSCREEN_DESKTOP ? 0 : SDL_WINDOW_FULLSCREEN_DESKTOP;
+                            sdl::call(SDL_SetWindowFullscreen, m_window.get(), set_fs);
+                            int w, h;
+                            SDL_GetWindowSize(m_window.get(), &w, &h);
+                            sdl::call(SDL_RenderSetLogicalSize, m_renderer.get(), w, h);
+                            break;
+                        }
+                    default:
+                        // auto repeat changes nothing for the machine
+                        if (!evt.key.repeat) {
+                            queue_key(evt.key.keysym.sym, true);
+                        }
                     }
+                    break;
+                case SDL_KEYUP:
+                    if (evt.key.keysym.sym == SDLK_BACKSPACE) {
+                        m_rewinding = false;
+                    }
+                    queue_key(evt.key.keysym.sym, false);
+                    break;
                 default:
-                    key_press(evt.key.keysym.sym);
+                    ;
                 }
-                break;
-            case SDL_KEYUP:
-                key_release(evt.key.keysym.sym);
-                break;
-            default:
-                ;
+            }
+
+            // the vsynced present paces this loop while frames come in, in between it waits
+            // for input so key changes reach the emulation thread without delay
+            if (m_frames.update() || m_redraw) {
+                render(m_frames.front());
+            } else {
+                SDL_WaitEventTimeout(nullptr, event_wait_ms);
             }
         }
+    } catch (...) {
+        m_done = true;
+        finish_run(emulation);
+        throw;
+    }
+
+    finish_run(emulation);
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+}
+
+void Window::finish_run(std::thread& emulation)
+{
+    emulation.join();
+    if (m_audio_device) {
+        SDL_PauseAudioDevice(m_audio_device, 1);
+    }
+    // a replay cut short still has its rate and quirks set, the next ROM mustn't run with them
+    m_player.reset();
+    m_scheduler.set_rate(m_rate, m_unlimited);
+    m_chip8.set_quirks(m_quirks);
+}
 
-        m_chip8.step();
+void Window::emulate()
+{
+    try {
+        StopWatch watch;
+        auto next = clock::now();
+        while (!m_done) {
+            // each pass emulates the host time since the last one, key changes from
+            // that time land on the instructions that correspond to when they happened
+            const auto start = watch.started();
+            const auto elapsed = watch.lap();
+            // jumping back in time would make the recording unreplayable
+            if (m_rewinding && !m_recorder && !m_player) {
+                take_input(start, elapsed, 0);
+                m_rewind.rewind(m_chip8);
+                sync_keys();
+            } else if (m_player) {
+                // the movie has the keyboard while replaying
+                take_input(start, elapsed, 0);
+                replay_slice();
+                if (!m_player) {
+                    sync_keys();
+                }
+            } else if (m_scheduler.unlimited()) {
+                // far above real time there's no telling which instruction ran when, keys change right away
+                take_input(start, elapsed, 0);
+                m_scheduler.run_events(0, m_key_events);
+                m_scheduler.advance(unlimited_slice);
+            } else {
+                const auto cycles = m_scheduler.cycles_due(elapsed);
+                take_input(start, elapsed, cycles);
+                m_scheduler.run_events(cycles, m_key_events);
+            }
+            if (!m_rewinding && !m_recorder && !m_player) {
+                m_rewind.push(m_chip8);
+            }
 
-        if (m_chip8.flags.cls) {
-            m_chip8.clear_screen();
+            if (m_chip8.take_dirty_rows()) {
+                publish();
+            }
             m_chip8.flags.cls = false;
+            m_chip8.flags.draw = false;
+
+            // unlimited mode and replays spend their slice running, everything else waits for the next tick
+            next += emulation_tick;
+            const auto now = clock::now();
+            if (m_player || m_scheduler.unlimited() || next < now) {
+                next = now;
+            } else {
+                std::this_thread::sleep_until(next);
+            }
         }
 
-        if (m_chip8.flags.draw) {
-            render();
-            m_chip8.flags.draw = false;
+        if (m_recorder) {
+            m_recorder->finish(m_scheduler.cycles());
         }
+    } catch (...) {
+        m_error = std::current_exception();
+        m_done = true;
+    }
+}
 
-        if (watch.elapsed_ms() >= 1000/60) {
-            m_chip8.count_down();
-            watch.update();
+void Window::publish()
+{
+    auto& frame = m_frames.back();
+    frame.hires = m_chip8.hires();
+    for (int p = 0; p < Chip8Cpu::planes; p++) {
+        for (int y = 0; y < frame.height(); y++) {
+            for (int w = 0; w < Chip8Cpu::row_words; w++) {
+                frame.gfx[p][y][w] = m_chip8.row(y, w, p);
+            }
         }
     }
+    m_frames.publish();
 }
 
-void Window::render()
+void Window::replay_slice()
 {
-    sdl::call(SDL_SetRenderDrawColor, m_renderer.get(), 0, 0, 0, 255);
-    sdl::call(SDL_RenderClear, m_renderer.get());
+    using clock = std::chrono::steady_clock;
+    const auto deadline = clock::now() + unlimited_slice;
+    do {
+        m_player->run(std::min(m_scheduler.cycles() + replay_chunk, m_replay_end));
+    } while (m_scheduler.cycles() < m_replay_end && clock::now() < deadline);
+
+    if (m_scheduler.cycles() >= m_replay_end) {
+        m_player.reset();
+        m_scheduler.set_rate(m_rate, m_unlimited);
+    }
+}
+
+void Window::render(const Frame& frame)
+{
+    const int width = frame.width();
+    const int height = frame.height();
+    // 00FE/00FF switch the resolution, the texture follows
+    if (width != m_canvas_width || height != m_canvas_height) {
+        m_canvas = sdl::Texture{sdl::call(SDL_CreateTexture, m_renderer.get(), SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING, width, height)};
+        m_canvas_width = width;
+        m_canvas_height = height;
+        m_redraw = true;
+    }
+
+    // frames the render side didn't get to are skipped, so compare against what is on the canvas
+    int first = 0;
+    int last = height - 1;
+    if (!m_redraw) {
+        const auto same = [&](int y) {
+            for (int p = 0; p < Chip8Cpu::planes; p++) {
+                for (int w = 0; w < width / 64; w++) {
+                    if (frame.gfx[p][y][w] != m_shown.gfx[p][y][w]) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        };
+        while (first < height && same(first)) {
+            first++;
+        }
+        while (last > first && same(last)) {
+            last--;
+        }
+        // nothing changed on screen, so there's nothing to present either
+        if (first == height) {
+            return;
+        }
+    }
+    m_redraw = false;
 
-    void* pixels_;
-    int pitch;
-    sdl::call(SDL_LockTexture, m_canvas.get(), nullptr, &pixels_, &pitch);
-    auto pixels = static_cast<Uint32*>(pixels_);
-    for (int y = 0; y < Chip8Cpu::screen_height; y++) {
-        for (int x = 0; x < Chip8Cpu::screen_width; x++) {
-            pixels[y * Chip8Cpu::screen_width + x] = m_chip8.gfx[y][x] ? static_cast<Uint32>(-1) : 0;
+    for (int y = first; y <= last; y++) {
+        auto* out = &m_pixels[(y - first) * width];
+        for (int w = 0; w < width / 64; w++) {
+            const auto bits0 = frame.gfx[0][y][w];
+            const auto bits1 = frame.gfx[1][y][w];
+            for (int x = 0; x < 64; x++) {
+                const auto shift = 63 - x;
+                out[w * 64 + x] = palette[((bits0 >> shift) & 1) | (((bits1 >> shift) & 1) << 1)];
+            }
         }
     }
-    sdl::call(SDL_UnlockTexture, m_canvas.get());
+    const SDL_Rect span{0, first, width, last - first + 1};
+    sdl::call(SDL_UpdateTexture, m_canvas.get(), &span, m_pixels.data(), static_cast<int>(width * sizeof(Uint32)));
+    m_shown = frame;
 
+    sdl::call(SDL_SetRenderDrawColor, m_renderer.get(), 0, 0, 0, 255);
+    sdl::call(SDL_RenderClear, m_renderer.get());
     sdl::call(SDL_RenderCopy, m_renderer.get(), m_canvas.get(), nullptr, nullptr);
     sdl::call(SDL_RenderPresent, m_renderer.get());
 }
 
-void Window::key_press(int key)
+void Window::queue_key(SDL_Keycode key, bool down)
+{
+    const auto chip8_key = m_keymap[key];
+    if (chip8_key < 0) {
+        return;
+    }
+    // the mask goes first, so whoever sees the event in the queue also sees it in there
+    const auto bit = static_cast<std::uint16_t>(1u << chip8_key);
+    const auto keys = m_host_keys.load(std::memory_order_relaxed);
+    m_host_keys.store(down ? keys | bit : keys & ~bit, std::memory_order_release);
+    if (!m_input.push({clock::now(), static_cast<std::uint8_t>(chip8_key), down})) {
+        m_input_lost.store(true, std::memory_order_release);
+    }
+}
+
+void Window::take_input(clock::time_point start, clock::duration elapsed, std::uint64_t cycles)
 {
-    auto& keys = m_chip8.keys;
-    switch (key) {
-    case SDLK_1:
-        keys[1] = 1;
-        break;
-    case SDLK_2:
-        keys[2] = 1;
-        break;
-    case SDLK_3:
-        keys[3] = 1;
-        break;
-    case SDLK_4:
-        keys[0xC] = 1;
-        break;
-    case SDLK_q:
-        keys[4] = 1;
-        break;
-    case SDLK_w:
-        keys[5] = 1;
-        break;
-    case SDLK_e:
-        keys[6] = 1;
-        break;
-    case SDLK_r:
-        keys[0xD] = 1;
-        break;
-    case SDLK_a:
-        keys[7] = 1;
-        break;
-    case SDLK_s:
-        keys[8] = 1;
-        break;
-    case SDLK_d:
-        keys[9] = 1;
-        break;
-    case SDLK_f:
-        keys[0xE] = 1;
-        break;
-    case SDLK_y:
-        keys[0xA] = 1;
-        break;
-    case SDLK_x:
-        keys[0] = 1;
-        break;
-    case SDLK_c:
-        keys[0xB] = 1;
-        break;
-    case SDLK_v:
-        keys[0xF] = 1;
-        break;
-    default:
-        ;
+    m_key_events.clear();
+    const auto first = m_scheduler.cycles();
+    const auto take = [&](const InputEvent& e) {
+        const auto bit = static_cast<std::uint16_t>(1u << e.key);
+        if (((m_held & bit) != 0) == e.down) {
+            return;
+        }
+        m_held ^= bit;
+
+        // events from after the slice ended, i.e. while it was being emulated, go on its last instruction
+        std::uint64_t offset = 0;
+        if (elapsed.count() > 0 && e.time > start) {
+            const auto fraction = std::min(1.0, std::chrono::duration<double>(e.time - start) / elapsed);
+            offset = static_cast<std::uint64_t>(fraction * static_cast<double>(cycles));
+        }
+        m_key_events.push_back({first + offset, e.key, e.down});
+        if (m_recorder) {
+            m_recorder->record(m_key_events.back());
+        }
+    };
+    for (InputEvent e; m_input.pop(e);) {
+        take(e);
+    }
+
+    // the queue overflowed, so changes are missing from it, releases included; the host
+    // mask is at least as new as anything drained, whatever still comes is a no-op then
+    if (m_input_lost.exchange(false, std::memory_order_acq_rel)) {
+        const auto now = clock::now();
+        const auto keys = m_host_keys.load(std::memory_order_acquire);
+        for (std::uint8_t key = 0; key < Chip8Cpu::keys_size; key++) {
+            take({now, key, ((keys >> key) & 1) != 0});
+        }
     }
 }
 
-void Window::key_release(int key)
+void Window::sync_keys()
 {
-    auto& keys = m_chip8.keys;
-    switch (key) {
-    case SDLK_1:
-        keys[1] = 0;
-        break;
-    case SDLK_2:
-        keys[2] = 0;
-        break;
-    case SDLK_3:
-        keys[3] = 0;
-        break;
-    case SDLK_4:
-        keys[0xC] = 0;
-        break;
-    case SDLK_q:
-        keys[4] = 0;
-        break;
-    case SDLK_w:
-        keys[5] = 0;
-        break;
-    case SDLK_e:
-        keys[6] = 0;
-        break;
-    case SDLK_r:
-        keys[0xD] = 0;
-        break;
-    case SDLK_a:
-        keys[7] = 0;
-        break;
-    case SDLK_s:
-        keys[8] = 0;
-        break;
-    case SDLK_d:
-        keys[9] = 0;
-        break;
-    case SDLK_f:
-        keys[0xE] = 0;
-        break;
-    case SDLK_y:
-        keys[0xA] = 0;
-        break;
-    case SDLK_x:
-        keys[0] = 0;
-        break;
-    case SDLK_c:
-        keys[0xB] = 0;
-        break;
-    case SDLK_v:
-        keys[0xF] = 0;
-        break;
-    default:
-        ;
+    for (std::uint8_t key = 0; key < Chip8Cpu::keys_size; key++) {
+        m_chip8.keys[key] = (m_held >> key) & 1;
     }
 }
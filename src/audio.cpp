@@ -0,0 +1,152 @@
+#include "audio.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+
+#include "scheduler.h"
+
+namespace
+{
+
+constexpr int pattern_bits = Chip8Cpu::audio_pattern_size * 8;
+
+// the buzzer without an XO-CHIP pattern: a 440 Hz square wave
+constexpr std::uint8_t buzzer_pattern[Chip8Cpu::audio_pattern_size] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+constexpr double buzzer_frequency = 440;
+
+// XO-CHIP plays the pattern at 4000 bits per second at the default pitch of 64
+double pattern_rate(std::uint8_t pitch)
+{
+    return 4000 * std::pow(2.0, (pitch - 64) / 48.0);
+}
+
+template <class Int>
+void put_value(std::ostream& out, Int v)
+{
+    for (std::size_t i = 0; i < sizeof(Int); i++) {
+        out.put(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+constexpr std::uint32_t wav_header_size = 44;
+
+}
+
+AudioStream::AudioStream(unsigned sample_rate, std::size_t capacity)
+    : m_sample_rate(std::max(sample_rate, Scheduler::timer_rate)), m_queue(capacity),
+      m_samples(m_sample_rate / Scheduler::timer_rate + 1)
+{
+}
+
+void AudioStream::tick(const Chip8Cpu& chip8)
+{
+    m_pending += m_sample_rate;
+    const auto count = m_pending / Scheduler::timer_rate;
+    m_pending -= count * Scheduler::timer_rate;
+
+    if (!chip8.sound_on()) {
+        std::fill_n(m_samples.begin(), count, std::int16_t{0});
+    } else {
+        const auto* pattern = buzzer_pattern;
+        double step = buzzer_frequency * pattern_bits / m_sample_rate;
+        if (chip8.custom_audio()) {
+            pattern = chip8.audio_pattern();
+            // the pitch rarely changes, keep pow() off the common path
+            if (chip8.pitch() != m_pitch || m_step == 0) {
+                m_pitch = chip8.pitch();
+                m_step = pattern_rate(m_pitch) / m_sample_rate;
+            }
+            step = m_step;
+        }
+
+        for (std::size_t i = 0; i < count; i++) {
+            const auto bit = static_cast<int>(m_phase);
+            const bool on = (pattern[bit / 8] >> (7 - bit % 8)) & 1;
+            m_samples[i] = on ? volume : -volume;
+            m_phase += step;
+            if (m_phase >= pattern_bits) {
+                m_phase -= pattern_bits * std::floor(m_phase / pattern_bits);
+            }
+        }
+    }
+
+    m_queue.write(m_samples.data(), count);
+}
+
+std::size_t AudioStream::read(std::int16_t* out, std::size_t count) noexcept
+{
+    const auto n = m_queue.read(out, count);
+    std::fill(out + n, out + count, std::int16_t{0});
+    return n;
+}
+
+WavWriter::WavWriter(const std::filesystem::path& path, unsigned sample_rate)
+    : m_out(path, std::ios::out | std::ios::binary | std::ios::trunc)
+{
+    if (!m_out) {
+        throw IOException("Can't write file " + path.u8string());
+    }
+
+    // sizes are patched in by finish()
+    m_out.write("RIFF", 4);
+    put_value(m_out, std::uint32_t{0});
+    m_out.write("WAVEfmt ", 8);
+    put_value(m_out, std::uint32_t{16});
+    put_value(m_out, std::uint16_t{1});
+    put_value(m_out, std::uint16_t{1});
+    put_value(m_out, std::uint32_t{sample_rate});
+    put_value(m_out, std::uint32_t{sample_rate * 2});
+    put_value(m_out, std::uint16_t{2});
+    put_value(m_out, std::uint16_t{16});
+    m_out.write("data", 4);
+    put_value(m_out, std::uint32_t{0});
+}
+
+WavWriter::~WavWriter()
+{
+    try {
+        finish();
+    } catch (...) {
+    }
+}
+
+void WavWriter::write(const std::int16_t* samples, std::size_t count)
+{
+    if (m_finished) {
+        throw IOException("Samples can't be written after finishing");
+    }
+
+    for (std::size_t i = 0; i < count; i++) {
+        put_value(m_out, samples[i]);
+    }
+    m_samples += static_cast<std::uint32_t>(count);
+}
+
+void WavWriter::drain(AudioStream& stream)
+{
+    std::int16_t buffer[1024];
+    while (const auto n = std::min(stream.available(), std::size(buffer))) {
+        write(buffer, stream.read(buffer, n));
+    }
+}
+
+void WavWriter::finish()
+{
+    if (m_finished) {
+        return;
+    }
+    m_finished = true;
+
+    const auto data_size = m_samples * 2;
+    m_out.seekp(4);
+    put_value(m_out, wav_header_size - 8 + data_size);
+    m_out.seekp(wav_header_size - 4);
+    put_value(m_out, data_size);
+    m_out.flush();
+    if (!m_out) {
+        throw IOException("Can't finish WAV file");
+    }
+}
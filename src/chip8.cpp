@@ -1,9 +1,18 @@
 #include "chip8.h"
+#include "native.h"
 
 #include <algorithm>
+#include <bitset>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <vector>
 
-#include "utils/random.h"
+#ifdef CHIP8_PROFILING
+#include <chrono>
+
+#include "profiler.h"
+#endif
 
 static constexpr std::array<std::uint8_t, 80> chip8_fontset = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -24,274 +33,1029 @@ static constexpr std::array<std::uint8_t, 80> chip8_fontset = {
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-std::array<Chip8Cpu::InterpreterFn, 16> Chip8Cpu::instructions = {
-    [](Chip8Cpu& cpu) {
-        switch (cpu.opcode) {
-        // clear screen
-        case 0x00E0:
-            cpu.flags.cls = true;
-            break;
-        // return from subroutine
-        case 0x00EE:
-            if (cpu.sp == 0) {
-                throw InterpreterException("Stack underflowed");
-            }
-            cpu.pc = cpu.stack[--cpu.sp];
-            break;
-        default:
-            throw InterpreterException("Instruction 0x0NNN is unsupported");
+// 8x10 digits for FX30, stored right after the small font
+static constexpr std::uint16_t big_font_start = 0x50;
+static constexpr std::array<std::uint8_t, 160> big_fontset = {
+    0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+    0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+    0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+    0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+    0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+    0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+    0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+    0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+    0x18, 0x3C, 0x66, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, // A
+    0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+    0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+    0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xFF, 0xFF, // E
+    0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFC, 0xC0, 0xC0, 0xC0, 0xC0  // F
+};
+static_assert(big_font_start == chip8_fontset.size());
+
+namespace
+{
+
+// quirk policies: each one compiles into its own handler table, so the handlers don't branch on them
+struct Chip8Quirks
+{
+    // 8XY6/8XYE shift VY into VX instead of shifting VX in place
+    static constexpr bool shift_vy = false;
+    // FX55/FX65 leave I pointing past the last register transferred
+    static constexpr bool load_store_increment_i = false;
+    // BXNN jumps to XNN + VX instead of NNN + V0
+    static constexpr bool jump_vx = false;
+    // DXYN clips sprites at the screen edges instead of wrapping them around
+    static constexpr bool clip_sprites = true;
+    // 8XY1/8XY2/8XY3 clear VF
+    static constexpr bool logic_reset_vf = false;
+    // SUPER-CHIP 1.1: 128x64 mode, scrolling, 16x16 sprites, big font and FX75/FX85
+    static constexpr bool schip_ops = false;
+    // XO-CHIP: F000 NNNN, 5XY2/5XY3, a second bit plane and audio patterns
+    static constexpr bool xo_ops = false;
+    static constexpr std::uint32_t memory_size = Chip8Cpu::memory_size;
+};
+
+struct SchipQuirks : Chip8Quirks
+{
+    static constexpr bool jump_vx = true;
+    static constexpr bool schip_ops = true;
+};
+
+struct CosmacVipQuirks : Chip8Quirks
+{
+    static constexpr bool shift_vy = true;
+    static constexpr bool load_store_increment_i = true;
+    static constexpr bool logic_reset_vf = true;
+};
+
+struct XochipQuirks : Chip8Quirks
+{
+    static constexpr bool shift_vy = true;
+    static constexpr bool load_store_increment_i = true;
+    static constexpr bool clip_sprites = false;
+    static constexpr bool schip_ops = true;
+    static constexpr bool xo_ops = true;
+    static constexpr std::uint32_t memory_size = Chip8Cpu::max_memory_size;
+};
+
+// opcodes decode() only recognises if the profile implements them
+struct Extensions
+{
+    bool schip;
+    bool xo;
+};
+
+template <class Q>
+constexpr Extensions extensions_of()
+{
+    return {Q::schip_ops, Q::xo_ops};
+}
+
+// indexed by Chip8Cpu::Quirks, like Chip8Cpu::handler_tables
+constexpr Extensions extensions[] = {
+    extensions_of<Chip8Quirks>(),
+    extensions_of<SchipQuirks>(),
+    extensions_of<CosmacVipQuirks>(),
+    extensions_of<XochipQuirks>(),
+};
+
+template <class Q>
+constexpr Chip8Cpu::QuirkFlags quirk_flags_of()
+{
+    return {Q::shift_vy, Q::logic_reset_vf, Q::xo_ops};
+}
+
+// indexed by Chip8Cpu::Quirks
+constexpr Chip8Cpu::QuirkFlags profile_quirk_flags[] = {
+    quirk_flags_of<Chip8Quirks>(),
+    quirk_flags_of<SchipQuirks>(),
+    quirk_flags_of<CosmacVipQuirks>(),
+    quirk_flags_of<XochipQuirks>(),
+};
+
+// indexed by Chip8Cpu::Quirks
+constexpr const char* profile_names[] = {"chip8", "schip", "cosmac_vip", "xochip"};
+
+int count_planes(std::uint8_t mask)
+{
+    return (mask & 1) + ((mask >> 1) & 1);
+}
+
+// splitmix64 finaliser, turns positions into unrelated keys
+constexpr std::uint64_t mix(std::uint64_t z)
+{
+    z += 0x9E3779B97F4A7C15;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+}
+
+constexpr int framebuffer_words = Chip8Cpu::planes * Chip8Cpu::hires_height * Chip8Cpu::row_words;
+
+// one odd key per framebuffer word, odd so that every bit of a word counts
+constexpr std::array<std::uint64_t, framebuffer_words> make_framebuffer_keys()
+{
+    std::array<std::uint64_t, framebuffer_words> keys{};
+    for (int i = 0; i < framebuffer_words; i++) {
+        keys[i] = mix(i) | 1;
+    }
+    return keys;
+}
+
+constexpr auto framebuffer_keys = make_framebuffer_keys();
+
+// memory is hashed in 8 byte words, their keys are computed when needed
+std::uint64_t memory_key(std::uint32_t word)
+{
+    return mix(framebuffer_words + word) | 1;
+}
+
+std::uint64_t memory_word(const std::uint8_t* memory, std::uint32_t word)
+{
+    std::uint64_t v;
+    std::memcpy(&v, memory + word * 8, sizeof(v));
+    return v;
+}
+
+}
+
+template <class Q>
+void Chip8Cpu::skip_next() noexcept
+{
+    // F000 NNNN is four bytes long, skipping it skips both halves
+    if constexpr (Q::xo_ops) {
+        if (pc + 3u < m_memory_size && fetch(static_cast<std::uint16_t>(pc + 2)) == 0xF000) {
+            pc += 2;
+        }
+    }
+    pc += 2;
+}
+
+// indexed by Chip8Cpu::Operation, operands are already extracted by decode()
+template <class Q>
+const Chip8Cpu::HandlerTable Chip8Cpu::handlers = {
+    // invalid
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.raise(Fault::invalid_opcode, ins);
+    },
+
+    // 0NNN: call machine code routine at NNN
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.raise(Fault::unsupported_opcode, ins);
+    },
+
+    // 00E0: clear screen, only the selected planes on XO-CHIP
+    [](Chip8Cpu& cpu, Instruction) {
+        cpu.clear_planes(cpu.m_plane_mask);
+        cpu.flags.cls = true;
+        cpu.m_events |= stop_on_draw;
+        cpu.pc += 2;
+    },
+
+    // 00EE: return from subroutine
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.sp == 0) {
+            return cpu.raise(Fault::stack_underflow, ins);
         }
+        cpu.pc = cpu.stack[--cpu.sp];
+        cpu.pc += 2;
+    },
+
+    // 00CN: scroll down N lines
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.scroll_vertical(ins.n);
+        cpu.pc += 2;
+    },
+
+    // 00DN: scroll up N lines
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.scroll_vertical(-ins.n);
+        cpu.pc += 2;
+    },
+
+    // 00FB: scroll right 4 pixels
+    [](Chip8Cpu& cpu, Instruction) {
+        cpu.scroll_horizontal(4);
+        cpu.pc += 2;
+    },
+
+    // 00FC: scroll left 4 pixels
+    [](Chip8Cpu& cpu, Instruction) {
+        cpu.scroll_horizontal(-4);
+        cpu.pc += 2;
+    },
+
+    // 00FD: exit the interpreter, the program counter stays on the instruction
+    [](Chip8Cpu& cpu, Instruction) {
+        cpu.m_events |= stop_on_exit;
+    },
+
+    // 00FE: switch to 64x32
+    [](Chip8Cpu& cpu, Instruction) {
+        cpu.set_hires(false);
+        cpu.pc += 2;
+    },
+
+    // 00FF: switch to 128x64
+    [](Chip8Cpu& cpu, Instruction) {
+        cpu.set_hires(true);
         cpu.pc += 2;
     },
 
     // 1NNN: jump to address NNN
-    [](Chip8Cpu& cpu) { // 0x1
-        cpu.pc = cpu.opcode & 0x0FFF;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.pc = ins.nnn();
     },
 
     // 2NNN: call subroutine at address NNN
-    [](Chip8Cpu& cpu) { // 0x2
+    [](Chip8Cpu& cpu, Instruction ins) {
         if (cpu.sp == stack_size) {
-            throw InterpreterException("Stack overflowed");
+            return cpu.raise(Fault::stack_overflow, ins);
         }
         cpu.stack[cpu.sp++] = cpu.pc;
-        cpu.pc = cpu.opcode & 0x0FFF;
+        cpu.pc = ins.nnn();
     },
 
     // 3XNN: skip next instruction if VX == NN
-    [](Chip8Cpu& cpu) { // 0x3
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        if (cpu.V[x] == (cpu.opcode & 0x00FF)) {
-            cpu.pc += 2;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.V[ins.x] == ins.nn) {
+            cpu.skip_next<Q>();
         }
         cpu.pc += 2;
     },
 
     // 4XNN: skip next instruction if VX != NN
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        if (cpu.V[x] != (cpu.opcode & 0x00FF)) {
-            cpu.pc += 2;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.V[ins.x] != ins.nn) {
+            cpu.skip_next<Q>();
         }
         cpu.pc += 2;
     },
 
-
     // 5XY0: skip next instruction if VX == VY
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        const auto y = (cpu.opcode & 0x00F0) >> 4;
-        if (cpu.V[x] == cpu.V[y]) {
-            cpu.pc += 2;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.V[ins.x] == cpu.V[ins.y]) {
+            cpu.skip_next<Q>();
+        }
+        cpu.pc += 2;
+    },
+
+    // 5XY2: store VX to VY (inclusive, in either direction) in memory starting at address I
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const int step = ins.x <= ins.y ? 1 : -1;
+        const int count = (ins.y - ins.x) * step + 1;
+        if (cpu.I + static_cast<std::uint32_t>(count) > Q::memory_size) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        std::uint8_t values[reg_size];
+        for (int i = 0; i < count; i++) {
+            values[i] = cpu.V[ins.x + i * step];
+        }
+        cpu.store(cpu.I, values, count);
+        cpu.pc += 2;
+    },
+
+    // 5XY3: fill VX to VY (inclusive, in either direction) with values from memory starting at address I
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const int step = ins.x <= ins.y ? 1 : -1;
+        const int count = (ins.y - ins.x) * step + 1;
+        if (cpu.I + static_cast<std::uint32_t>(count) > Q::memory_size) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        for (int i = 0; i < count; i++) {
+            cpu.V[ins.x + i * step] = cpu.memory[cpu.I + i];
         }
         cpu.pc += 2;
     },
 
     // 6XNN: set VX to NN
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        cpu.V[x] = cpu.opcode & 0x00FF;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = ins.nn;
         cpu.pc += 2;
     },
 
     // 7XNN: adds NN to VX
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        cpu.V[x] += cpu.opcode & 0x00FF;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] += ins.nn;
         cpu.pc += 2;
     },
 
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        const auto y = (cpu.opcode & 0x00F0) >> 4;
-        switch (cpu.opcode & 0x000F) {
-        // 8XY0: Set VX to the value of VY
-        case 0:
-            cpu.V[x] = cpu.V[y];
-            break;
-        case 1:
-            cpu.V[x] = cpu.V[x] | cpu.V[y];
-            break;
-        case 2:
-            cpu.V[x] = cpu.V[x] & cpu.V[y];
-            break;
-        case 3:
-            cpu.V[x] = cpu.V[x] ^ cpu.V[y];
-            break;
-        case 4:
-            cpu.V[0xF] = cpu.V[y] > (0xFF - cpu.V[x]) ? 1 : 0;
-            cpu.V[x] += cpu.V[y];
-            break;
-        case 5:
-            cpu.V[0xF] = cpu.V[x] < cpu.V[y] ? 0 : 1;
-            cpu.V[x] -= cpu.V[y];
-            break;
-        case 6:
-            cpu.V[0xF] = cpu.V[x] & 0x01;
-            cpu.V[x] >>= 1;
-            break;
-        case 7:
-            cpu.V[0xF] = cpu.V[y] < cpu.V[x] ? 1 : 0;
-            cpu.V[x] = cpu.V[y] - cpu.V[x];
-            break;
-        case 0xE:
-            cpu.V[0xF] = cpu.V[x] >> 7;
-            cpu.V[x] <<= 1;
-            break;
-        default:
-            throw InterpreterException("Instruction {0:#X} is not a Chip8 opcode", cpu.opcode);
+    // 8XY0: set VX to the value of VY
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = cpu.V[ins.y];
+        cpu.pc += 2;
+    },
+
+    // 8XY1: set VX to VX | VY
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = cpu.V[ins.x] | cpu.V[ins.y];
+        if constexpr (Q::logic_reset_vf) {
+            cpu.V[0xF] = 0;
+        }
+        cpu.pc += 2;
+    },
+
+    // 8XY2: set VX to VX & VY
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = cpu.V[ins.x] & cpu.V[ins.y];
+        if constexpr (Q::logic_reset_vf) {
+            cpu.V[0xF] = 0;
+        }
+        cpu.pc += 2;
+    },
+
+    // 8XY3: set VX to VX ^ VY
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = cpu.V[ins.x] ^ cpu.V[ins.y];
+        if constexpr (Q::logic_reset_vf) {
+            cpu.V[0xF] = 0;
         }
         cpu.pc += 2;
     },
 
+    // 8XY4: add VY to VX, VF is set to the carry
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[0xF] = cpu.V[ins.y] > (0xFF - cpu.V[ins.x]) ? 1 : 0;
+        cpu.V[ins.x] += cpu.V[ins.y];
+        cpu.pc += 2;
+    },
+
+    // 8XY5: subtract VY from VX, VF is set to NOT borrow
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[0xF] = cpu.V[ins.x] < cpu.V[ins.y] ? 0 : 1;
+        cpu.V[ins.x] -= cpu.V[ins.y];
+        cpu.pc += 2;
+    },
+
+    // 8XY6: shift VX (or VY) right by one into VX, VF is set to the shifted out bit
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const auto value = cpu.V[Q::shift_vy ? ins.y : ins.x];
+        cpu.V[0xF] = value & 0x01;
+        cpu.V[ins.x] = value >> 1;
+        cpu.pc += 2;
+    },
+
+    // 8XY7: set VX to VY - VX, VF is set to NOT borrow
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[0xF] = cpu.V[ins.y] < cpu.V[ins.x] ? 1 : 0;
+        cpu.V[ins.x] = cpu.V[ins.y] - cpu.V[ins.x];
+        cpu.pc += 2;
+    },
+
+    // 8XYE: shift VX (or VY) left by one into VX, VF is set to the shifted out bit
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const auto value = cpu.V[Q::shift_vy ? ins.y : ins.x];
+        cpu.V[0xF] = value >> 7;
+        cpu.V[ins.x] = static_cast<std::uint8_t>(value << 1);
+        cpu.pc += 2;
+    },
+
     // 9XY0: skip next instruction if VX != VY
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        const auto y = (cpu.opcode & 0x00F0) >> 4;
-        if (cpu.V[x] != cpu.V[y]) {
-            cpu.pc += 2;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.V[ins.x] != cpu.V[ins.y]) {
+            cpu.skip_next<Q>();
         }
         cpu.pc += 2;
     },
 
     // ANNN: set I to address NNN
-    [](Chip8Cpu& cpu) {
-        cpu.I = cpu.opcode & 0x0FFF;
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.I = ins.nnn();
         cpu.pc += 2;
     },
 
-    // BNNN: jump to address NNN + V0
-    [](Chip8Cpu& cpu) {
-        cpu.pc = cpu.opcode & 0x0FFF;
-        cpu.pc += cpu.V[0];
+    // BNNN: jump to address NNN + V0 (or XNN + VX)
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.pc = ins.nnn();
+        cpu.pc += cpu.V[Q::jump_vx ? ins.x : 0];
     },
 
     // CXNN: store bitwise AND operation of NN and random number in VX
-    [](Chip8Cpu& cpu) {
-        const auto i = (cpu.opcode & 0x0F00) >> 8;
-        cpu.V[i] = (cpu.opcode & 0x00FF) & utils::random<std::uint16_t>();
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = ins.nn & cpu.rng.byte();
         cpu.pc += 2;
     },
 
-    [](Chip8Cpu& cpu) {
-        const auto xpos = cpu.V[(cpu.opcode & 0x0F00) >> 8];
-        const auto ypos = cpu.V[(cpu.opcode & 0x00F0) >> 4];
-        const int height = cpu.opcode & 0x000F;
+    // DXYN: draw sprite of height N stored at I to position (VX, VY), DXY0 draws 16x16 on SCHIP.
+    // XO-CHIP draws the sprite into each selected plane in turn, reading the planes' data back to back
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const bool wide = Q::schip_ops && ins.n == 0;
+        const int rows = wide ? 16 : ins.n;
+        const int bytes = wide ? 2 : 1;
+        if (cpu.I + static_cast<std::uint32_t>(rows * bytes * count_planes(cpu.m_plane_mask)) > Q::memory_size) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+
+        // the start position always wraps around, the sprite itself is clipped or wrapped
+        const int width = cpu.width();
+        const int height = cpu.height();
+        const int xpos = cpu.V[ins.x] % width;
+        const int ypos = cpu.V[ins.y] % height;
+        const int visible = Q::clip_sprites ? std::min(rows, height - ypos) : rows;
+
+        std::uint64_t collision = 0;
+        const std::uint8_t* data = cpu.memory.data() + cpu.I;
+        for (int p = 0; p < planes; p++) {
+            if (!(cpu.m_plane_mask & (1 << p))) {
+                continue;
+            }
 
-        cpu.V[0xF] = 0;
-        for (int y = 0; y < height; y++) {
-            const auto pixel = cpu.memory[cpu.I + y];
-            for (int x = 0; x < 8; x++) {
-                if (pixel & (0x80 >> x)) {
-                    if (cpu.gfx[ypos + y][xpos + x]) {
-                        cpu.V[0xF] = 1;
+            for (int y = 0; y < visible; y++) {
+                // the sprite line left aligned in a word
+                auto line = std::uint64_t{data[y * bytes]} << 56;
+                if (wide) {
+                    line |= std::uint64_t{data[y * bytes + 1]} << 48;
+                }
+                const int ydst = Q::clip_sprites ? ypos + y : (ypos + y) % height;
+                auto* row = cpu.gfx[p][ydst];
+                const auto* keys = &framebuffer_keys[(p * hires_height + ydst) * row_words];
+
+                std::uint64_t changed;
+                if (width == 64) {
+                    std::uint64_t sprite;
+                    if constexpr (Q::clip_sprites) {
+                        sprite = line >> xpos;
+                    } else {
+                        sprite = xpos ? (line >> xpos) | (line << (64 - xpos)) : line;
+                    }
+                    collision |= row[0] & sprite;
+                    const auto old = row[0];
+                    row[0] ^= sprite;
+                    cpu.m_framebuffer_hash += keys[0] * (row[0] - old);
+                    changed = sprite;
+                } else {
+                    // place the line in a 128 bit row, what runs off the right edge wraps to word 0
+                    const int shift = xpos % 64;
+                    const auto head = line >> shift;
+                    const auto tail = shift ? line << (64 - shift) : 0;
+                    std::uint64_t sprite[row_words];
+                    if (xpos < 64) {
+                        sprite[0] = head;
+                        sprite[1] = tail;
+                    } else {
+                        sprite[0] = Q::clip_sprites ? 0 : tail;
+                        sprite[1] = head;
+                    }
+                    collision |= (row[0] & sprite[0]) | (row[1] & sprite[1]);
+                    for (int w = 0; w < row_words; w++) {
+                        const auto old = row[w];
+                        row[w] ^= sprite[w];
+                        cpu.m_framebuffer_hash += keys[w] * (row[w] - old);
                     }
-                    cpu.gfx[ypos + y][xpos + x] ^= 1;
+                    changed = sprite[0] | sprite[1];
+                }
+                if (changed) {
+                    cpu.dirty_rows |= std::uint64_t{1} << ydst;
                 }
             }
+            data += rows * bytes;
         }
 
+        cpu.V[0xF] = collision ? 1 : 0;
         cpu.flags.draw = true;
+        cpu.m_events |= stop_on_draw;
         cpu.pc += 2;
     },
 
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        const auto k = cpu.V[x];
+    // EX9E: skip next instruction if key stored in VX is pressed
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const auto k = cpu.V[ins.x];
         if (k >= keys_size) {
-            throw InterpreterException("Key stored in register V[{0:d}] out of range", x);
+            return cpu.raise(Fault::key_out_of_range, ins);
         }
-        switch (cpu.opcode & 0x00FF) {
-        // skip next instruction if key stored in VX is pressed
-        case 0x9E:
-            if (cpu.keys[k]) {
-                cpu.pc += 2;
-            }
-            break;
-        // skip next instruction if key stored in VX isn't pressed
-        case 0xA1:
-            if (!cpu.keys[k]) {
+        if (cpu.keys[k]) {
+            cpu.skip_next<Q>();
+        }
+        cpu.pc += 2;
+    },
+
+    // EXA1: skip next instruction if key stored in VX isn't pressed
+    [](Chip8Cpu& cpu, Instruction ins) {
+        const auto k = cpu.V[ins.x];
+        if (k >= keys_size) {
+            return cpu.raise(Fault::key_out_of_range, ins);
+        }
+        if (!cpu.keys[k]) {
+            cpu.skip_next<Q>();
+        }
+        cpu.pc += 2;
+    },
+
+    // F000 NNNN: set I to the 16 bit address NNNN
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.pc + 3u >= Q::memory_size) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        cpu.I = cpu.fetch(static_cast<std::uint16_t>(cpu.pc + 2));
+        cpu.pc += 4;
+    },
+
+    // FN01: select the planes N that drawing, clearing and scrolling work on
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.m_plane_mask = ins.x & 0x3;
+        cpu.pc += 2;
+    },
+
+    // F002: load the 16 byte audio pattern at I
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.I + std::uint32_t{audio_pattern_size} > Q::memory_size) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        std::copy_n(cpu.memory.data() + cpu.I, audio_pattern_size, cpu.m_audio_pattern);
+        cpu.m_custom_audio = true;
+        cpu.pc += 2;
+    },
+
+    // FX07: set VX to the value of the delay timer
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.V[ins.x] = cpu.delay_timer;
+        cpu.pc += 2;
+    },
+
+    // FX0A: await key press and then store it in VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        for (std::uint8_t i = 0; i < keys_size; i++) {
+            if (cpu.keys[i]) {
+                cpu.V[ins.x] = i;
                 cpu.pc += 2;
+                return;
             }
-            break;
-        default:
-            throw InterpreterException("Instruction {0:#X} is not a Chip8 opcode", cpu.opcode);
         }
+        cpu.m_events |= stop_on_key_wait;
+    },
 
+    // FX15: set delay timer to VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.delay_timer = cpu.V[ins.x];
         cpu.pc += 2;
     },
 
-    [](Chip8Cpu& cpu) {
-        const auto x = (cpu.opcode & 0x0F00) >> 8;
-        switch (cpu.opcode & 0x00FF) {
-        // set VX to the value of the delay timer
-        case 0x07:
-            cpu.V[x] = cpu.delay_timer;
-            break;
-        // await key press and then store it in VX
-        case 0x0A:
-            cpu.pc -= 2;
-            for (std::uint8_t i = 0; i < keys_size; i++) {
-                if (cpu.keys[i]) {
-                    cpu.V[x] = i;
-                    cpu.pc += 2;
-                    break;
-                }
-            }
-            break;
-        // set delay timer to VX
-        case 0x15:
-            cpu.delay_timer = cpu.V[x];
-            break;
-        // set sound timer to VX
-        case 0x18:
-            cpu.sound_timer = cpu.V[x];
-            break;
-        // add VX to I
-        case 0x1E:
-            cpu.I += cpu.V[x];
-            break;
-        // set I to the location of the sprite for the character in VX
-        case 0x29:
-            if (cpu.V[x] > 0xF) {
-                throw InterpreterException("Character in register V[{0:d}] not representable", x);
+    // FX18: set sound timer to VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.sound_timer = cpu.V[ins.x];
+        cpu.pc += 2;
+    },
+
+    // FX1E: add VX to I
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.I += cpu.V[ins.x];
+        cpu.pc += 2;
+    },
+
+    // FX29: set I to the location of the sprite for the character in VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.V[ins.x] > 0xF) {
+            return cpu.raise(Fault::font_out_of_range, ins);
+        }
+        cpu.I = cpu.V[ins.x] * 5;
+        cpu.pc += 2;
+    },
+
+    // FX30: set I to the location of the 8x10 sprite for the character in VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.V[ins.x] > 0xF) {
+            return cpu.raise(Fault::font_out_of_range, ins);
+        }
+        cpu.I = big_font_start + cpu.V[ins.x] * 10;
+        cpu.pc += 2;
+    },
+
+    // FX33: store the binary-coded decimal representation of VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.I > Q::memory_size - 3) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        const auto vx = cpu.V[ins.x];
+        const std::uint8_t digits[] = {static_cast<std::uint8_t>(vx / 100), static_cast<std::uint8_t>((vx % 100) / 10), static_cast<std::uint8_t>(vx % 10)};
+        cpu.store(cpu.I, digits, 3);
+        cpu.pc += 2;
+    },
+
+    // FX3A: set the audio pattern playback pitch to VX
+    [](Chip8Cpu& cpu, Instruction ins) {
+        cpu.m_pitch = cpu.V[ins.x];
+        cpu.pc += 2;
+    },
+
+    // FX55: store V0 to VX (inclusive) in memory starting at address I
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.I >= Q::memory_size - ins.x) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        cpu.store(cpu.I, cpu.V, ins.x + 1);
+        if constexpr (Q::load_store_increment_i) {
+            cpu.I += ins.x + 1;
+        }
+        cpu.pc += 2;
+    },
+
+    // FX65: fill V0 to VX (inclusive) with values from memory starting at address I
+    [](Chip8Cpu& cpu, Instruction ins) {
+        if (cpu.I >= Q::memory_size - ins.x) {
+            return cpu.raise(Fault::memory_out_of_range, ins);
+        }
+        std::copy_n(cpu.memory.data() + cpu.I, ins.x + 1, cpu.V);
+        if constexpr (Q::load_store_increment_i) {
+            cpu.I += ins.x + 1;
+        }
+        cpu.pc += 2;
+    },
+
+    // FX75: save V0 to VX (inclusive) in the persistent flags
+    [](Chip8Cpu& cpu, Instruction ins) {
+        std::copy_n(cpu.V, ins.x + 1, cpu.rpl);
+        cpu.pc += 2;
+    },
+
+    // FX85: restore V0 to VX (inclusive) from the persistent flags
+    [](Chip8Cpu& cpu, Instruction ins) {
+        std::copy_n(cpu.rpl, ins.x + 1, cpu.V);
+        cpu.pc += 2;
+    }
+};
+
+// translated blocks live back to back in one buffer, looked up by their start address
+struct Chip8Cpu::BlockCache
+{
+    struct Entry
+    {
+        std::uint32_t offset = 0;
+        std::uint16_t length = 0;
+    };
+
+    // room for every instruction in memory plus one more block, the run loop never grows it
+    explicit BlockCache(std::uint32_t size)
+        : entries(size)
+    {
+        code.reserve(size / 2 + max_block_length);
+    }
+
+    std::vector<Instruction> code;
+    std::vector<Entry> entries;
+    std::bitset<max_memory_size> covered;
+    bool stale = false;
+
+    void flush()
+    {
+        code.clear();
+        std::fill(entries.begin(), entries.end(), Entry{});
+        covered.reset();
+        stale = false;
+    }
+};
+
+// placeholder for cache slots whose memory hasn't been decoded yet or has been overwritten
+const Chip8Cpu::Instruction Chip8Cpu::undecoded = {&Chip8Cpu::decode_and_execute, 0, 0, 0, 0, 0, Operation::invalid};
+
+Chip8Cpu::Chip8Cpu()
+{
+    decoded.assign(m_memory_size / 2, undecoded);
+    store(0, chip8_fontset.data(), chip8_fontset.size());
+    store(big_font_start, big_fontset.data(), big_fontset.size());
+}
+
+Chip8Cpu::~Chip8Cpu() = default;
+Chip8Cpu::Chip8Cpu(Chip8Cpu&&) noexcept = default;
+Chip8Cpu& Chip8Cpu::operator =(Chip8Cpu&&) noexcept = default;
+
+void Chip8Cpu::set_quirks(Quirks quirks)
+{
+    m_quirks = quirks;
+    const auto size = quirks == Quirks::xochip ? XochipQuirks::memory_size : memory_size;
+    if (size != m_memory_size) {
+        // growing adds zeros, shrinking drops what lay beyond the new limit
+        m_memory_size = size;
+        memory.resize(m_memory_size);
+        rehash_memory();
+        decoded.resize(m_memory_size / 2);
+        if (blocks) {
+            blocks = std::make_unique<BlockCache>(m_memory_size);
+        }
+    }
+    invalidate_all();
+}
+
+void Chip8Cpu::set_engine(Engine engine)
+{
+    if (engine == Engine::block && !blocks) {
+        blocks = std::make_unique<BlockCache>(m_memory_size);
+    }
+    m_engine = engine;
+}
+
+Chip8Cpu::QuirkFlags Chip8Cpu::quirk_flags(Quirks quirks) noexcept
+{
+    return profile_quirk_flags[static_cast<std::size_t>(quirks)];
+}
+
+const char* Chip8Cpu::quirks_name(Quirks quirks) noexcept
+{
+    return profile_names[static_cast<std::size_t>(quirks)];
+}
+
+std::optional<Chip8Cpu::Quirks> Chip8Cpu::parse_quirks(std::string_view name) noexcept
+{
+    for (std::size_t i = 0; i < std::size(profile_names); i++) {
+        if (name == profile_names[i]) {
+            return static_cast<Quirks>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+std::string Chip8Cpu::quirks_names()
+{
+    std::string names;
+    for (const auto* name : profile_names) {
+        names += names.empty() ? name : std::string{", "} + name;
+    }
+    return names;
+}
+
+void Chip8Cpu::seed(std::uint32_t value)
+{
+    rng = utils::Random(value);
+}
+
+// indexed by Chip8Cpu::Quirks
+const Chip8Cpu::HandlerTable* const Chip8Cpu::handler_tables[] = {
+    &Chip8Cpu::handlers<Chip8Quirks>,
+    &Chip8Cpu::handlers<SchipQuirks>,
+    &Chip8Cpu::handlers<CosmacVipQuirks>,
+    &Chip8Cpu::handlers<XochipQuirks>,
+};
+
+Chip8Cpu::Instruction Chip8Cpu::decode(std::uint16_t opcode, Quirks quirks)
+{
+    const auto ext = extensions[static_cast<std::size_t>(quirks)];
+    auto op = Operation::invalid;
+    switch ((opcode & 0xF000) >> 12) {
+    case 0x0:
+        switch (opcode) {
+        case 0x00E0: op = Operation::cls; break;
+        case 0x00EE: op = Operation::ret; break;
+        case 0x00FB: op = ext.schip ? Operation::scroll_right : Operation::sys; break;
+        case 0x00FC: op = ext.schip ? Operation::scroll_left : Operation::sys; break;
+        case 0x00FD: op = ext.schip ? Operation::exit : Operation::sys; break;
+        case 0x00FE: op = ext.schip ? Operation::lores : Operation::sys; break;
+        case 0x00FF: op = ext.schip ? Operation::hires : Operation::sys; break;
+        default:
+            if (ext.schip && (opcode & 0xFFF0) == 0x00C0) {
+                op = Operation::scroll_down;
+            } else if (ext.xo && (opcode & 0xFFF0) == 0x00D0) {
+                op = Operation::scroll_up;
+            } else {
+                op = Operation::sys;
             }
-            cpu.I = cpu.V[x] * 5;
-            break;
-        // store the binary-coded decimal representation of VX
-        case 0x33:
-        {
-            const auto i = cpu.I;
-            const auto vx = cpu.V[x];
-            cpu.memory[i] = vx / 100;
-            cpu.memory[i + 1] = (vx % 100) / 10;
-            cpu.memory[i + 2] = vx % 10;
+        }
+        break;
+    case 0x1: op = Operation::jp; break;
+    case 0x2: op = Operation::call; break;
+    case 0x3: op = Operation::se_imm; break;
+    case 0x4: op = Operation::sne_imm; break;
+    case 0x5:
+        switch (opcode & 0x000F) {
+        case 0x2: op = ext.xo ? Operation::save_range : Operation::se_reg; break;
+        case 0x3: op = ext.xo ? Operation::load_range : Operation::se_reg; break;
+        default: op = Operation::se_reg;
+        }
+        break;
+    case 0x6: op = Operation::ld_imm; break;
+    case 0x7: op = Operation::add_imm; break;
+    case 0x8:
+        switch (opcode & 0x000F) {
+        case 0x0: op = Operation::ld_reg; break;
+        case 0x1: op = Operation::or_reg; break;
+        case 0x2: op = Operation::and_reg; break;
+        case 0x3: op = Operation::xor_reg; break;
+        case 0x4: op = Operation::add_reg; break;
+        case 0x5: op = Operation::sub_reg; break;
+        case 0x6: op = Operation::shr; break;
+        case 0x7: op = Operation::subn_reg; break;
+        case 0xE: op = Operation::shl; break;
+        default: ;
+        }
+        break;
+    case 0x9: op = Operation::sne_reg; break;
+    case 0xA: op = Operation::ld_i; break;
+    case 0xB: op = Operation::jp_v0; break;
+    case 0xC: op = Operation::rnd; break;
+    case 0xD: op = Operation::drw; break;
+    case 0xE:
+        switch (opcode & 0x00FF) {
+        case 0x9E: op = Operation::skp; break;
+        case 0xA1: op = Operation::sknp; break;
+        default: ;
+        }
+        break;
+    case 0xF:
+        if (ext.xo && opcode == 0xF000) {
+            op = Operation::ld_i_long;
             break;
         }
-        // store V0 to VX (inclusive) in memory starting at address I
-        case 0x55:
-            if (cpu.I >= memory_size - x) {
-                throw InterpreterException("Can't copy registers to memory: address register out of range");
-            }
-            std::copy_n(cpu.V, x + 1, cpu.memory + cpu.I);
+        if (ext.xo && opcode == 0xF002) {
+            op = Operation::audio;
             break;
-        // fill V0 to VX (inclusive) with values from memory starting at address I
-        case 0x65:
-            if (cpu.I >= memory_size - x) {
-                throw InterpreterException("Can't copy memory to registers: address register out of range");
+        }
+        switch (opcode & 0x00FF) {
+        case 0x01: op = ext.xo ? Operation::plane : Operation::invalid; break;
+        case 0x07: op = Operation::ld_vx_dt; break;
+        case 0x0A: op = Operation::ld_key; break;
+        case 0x15: op = Operation::ld_dt; break;
+        case 0x18: op = Operation::ld_st; break;
+        case 0x1E: op = Operation::add_i; break;
+        case 0x29: op = Operation::ld_font; break;
+        case 0x30: op = ext.schip ? Operation::ld_hifont : Operation::invalid; break;
+        case 0x33: op = Operation::ld_bcd; break;
+        case 0x3A: op = ext.xo ? Operation::pitch : Operation::invalid; break;
+        case 0x55: op = Operation::ld_store; break;
+        case 0x65: op = Operation::ld_load; break;
+        case 0x75: op = ext.schip ? Operation::save_flags : Operation::invalid; break;
+        case 0x85: op = ext.schip ? Operation::load_flags : Operation::invalid; break;
+        default: ;
+        }
+        break;
+    default: ;
+    }
+
+    Instruction ins;
+    ins.fn = (*handler_tables[static_cast<std::size_t>(quirks)])[static_cast<std::size_t>(op)];
+    ins.opcode = opcode;
+    ins.x = static_cast<std::uint8_t>((opcode & 0x0F00) >> 8);
+    ins.y = static_cast<std::uint8_t>((opcode & 0x00F0) >> 4);
+    ins.n = static_cast<std::uint8_t>(opcode & 0x000F);
+    ins.nn = static_cast<std::uint8_t>(opcode & 0x00FF);
+    ins.op = op;
+    return ins;
+}
+
+void Chip8Cpu::decode_and_execute(Chip8Cpu& cpu, Instruction)
+{
+    auto& slot = cpu.decoded[cpu.pc >> 1];
+    slot = decode(cpu.fetch(cpu.pc), cpu.m_quirks);
+    // run a copy, the handler may overwrite its own slot through FX33/FX55
+    const auto ins = slot;
+    ins.fn(cpu, ins);
+}
+
+#ifdef CHIP8_PROFILING
+void Chip8Cpu::execute_profiled(const Instruction& ins)
+{
+    using clock = std::chrono::steady_clock;
+
+    // slots that haven't been decoded yet would all show up as invalid
+    const auto addr = pc;
+    const auto actual = ins.fn == &decode_and_execute ? decode(fetch(addr), m_quirks) : ins;
+    if (Profiler::timed(actual.op)) {
+        const auto start = clock::now();
+        ins.fn(*this, ins);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start);
+        m_profiler->record(addr, actual.op, actual.opcode, elapsed, m_fault.fault == Fault::none);
+    } else {
+        ins.fn(*this, ins);
+        m_profiler->record(addr, actual.op, actual.opcode, {}, m_fault.fault == Fault::none);
+    }
+}
+#endif
+
+void Chip8Cpu::store(std::uint32_t addr, const std::uint8_t* data, std::size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+
+    // take the touched words out of the hash, write, and put them back in
+    const auto first = addr / 8;
+    const auto last = static_cast<std::uint32_t>((addr + size - 1) / 8);
+    for (auto w = first; w <= last; w++) {
+        m_memory_hash -= memory_key(w) * memory_word(memory.data(), w);
+    }
+    std::memcpy(memory.data() + addr, data, size);
+    for (auto w = first; w <= last; w++) {
+        m_memory_hash += memory_key(w) * memory_word(memory.data(), w);
+    }
+
+    invalidate(static_cast<std::uint16_t>(addr), static_cast<std::uint16_t>(size));
+}
+
+void Chip8Cpu::rehash_framebuffer() noexcept
+{
+    const auto* words = &gfx[0][0][0];
+    std::uint64_t hash = 0;
+    for (int i = 0; i < framebuffer_words; i++) {
+        hash += framebuffer_keys[i] * words[i];
+    }
+    m_framebuffer_hash = hash;
+}
+
+void Chip8Cpu::rehash_memory() noexcept
+{
+    std::uint64_t hash = 0;
+    for (std::uint32_t w = 0; w < m_memory_size / 8; w++) {
+        hash += memory_key(w) * memory_word(memory.data(), w);
+    }
+    m_memory_hash = hash;
+}
+
+std::uint64_t Chip8Cpu::framebuffer_hash() const noexcept
+{
+    // the same pixels at another resolution are another picture
+    return m_hires ? ~m_framebuffer_hash : m_framebuffer_hash;
+}
+
+std::uint64_t Chip8Cpu::state_hash() const noexcept
+{
+    // the big parts are kept up to date, everything else is a few dozen bytes
+    auto hash = mix(framebuffer_hash()) ^ mix(m_memory_hash + 1);
+    const auto add = [&hash](std::uint64_t v) {
+        hash = mix(hash ^ v);
+    };
+    add(std::uint64_t{I} | std::uint64_t{pc} << 16 | std::uint64_t{sp} << 32 | std::uint64_t{delay_timer} << 40 | std::uint64_t{sound_timer} << 48);
+    for (int i = 0; i < reg_size; i += 8) {
+        add(memory_word(V, i / 8));
+    }
+    for (int i = 0; i < stack_size; i += 4) {
+        add(std::uint64_t{stack[i]} | std::uint64_t{stack[i + 1]} << 16 | std::uint64_t{stack[i + 2]} << 32 | std::uint64_t{stack[i + 3]} << 48);
+    }
+    for (int i = 0; i < keys_size; i += 8) {
+        add(memory_word(keys, i / 8));
+    }
+    for (int i = 0; i < flags_size; i += 8) {
+        add(memory_word(rpl, i / 8));
+    }
+    for (int i = 0; i < audio_pattern_size; i += 8) {
+        add(memory_word(m_audio_pattern, i / 8));
+    }
+    const auto& r = rng.state();
+    add(std::uint64_t{r[0]} | std::uint64_t{r[1]} << 32);
+    add(std::uint64_t{r[2]} | std::uint64_t{r[3]} << 32);
+    add(std::uint64_t{m_plane_mask} | std::uint64_t{m_pitch} << 8 | std::uint64_t{m_custom_audio} << 16);
+    return hash;
+}
+
+bool Chip8Cpu::ends_block(Operation op)
+{
+    switch (op) {
+    case Operation::ret:
+    case Operation::jp:
+    case Operation::call:
+    case Operation::se_imm:
+    case Operation::sne_imm:
+    case Operation::se_reg:
+    case Operation::sne_reg:
+    case Operation::jp_v0:
+    case Operation::skp:
+    case Operation::sknp:
+    case Operation::ld_key:
+    // memory writes may hit the rest of the block, so they end it as well
+    case Operation::ld_bcd:
+    case Operation::ld_store:
+    case Operation::save_range:
+    // F000 is followed by its operand, 00FD doesn't advance
+    case Operation::ld_i_long:
+    case Operation::exit:
+    case Operation::invalid:
+    case Operation::sys:
+        return true;
+    default:
+        return false;
+    }
+}
+
+std::uint16_t Chip8Cpu::fetch(std::uint16_t addr) const
+{
+    return static_cast<std::uint16_t>((memory[addr] << 8) | memory[addr + 1]);
+}
+
+void Chip8Cpu::invalidate(std::uint16_t addr, std::uint16_t len)
+{
+    const std::size_t first = addr >> 1;
+    const std::size_t last = std::min<std::size_t>((addr + len + 1) >> 1, decoded.size());
+    for (auto i = first; i < last; i++) {
+        decoded[i] = undecoded;
+    }
+
+    // the block being executed may be the one that's overwritten, so only mark
+    // the cache here and let run_blocks() flush it before the next lookup
+    if (blocks && !blocks->stale) {
+        for (std::size_t a = addr; a < addr + len && a < m_memory_size; a++) {
+            if (blocks->covered[a]) {
+                blocks->stale = true;
+                break;
             }
-            std::copy_n(cpu.memory + cpu.I, x + 1, cpu.V);
-            break;
-        default:
-            throw InterpreterException("Instruction {0:#X} is not a Chip8 opcode", cpu.opcode);
         }
-        cpu.pc += 2;
     }
-};
+}
 
-Chip8Cpu::Chip8Cpu()
+void Chip8Cpu::invalidate_all()
 {
-    std::copy(chip8_fontset.begin(), chip8_fontset.end(), memory);
+    std::fill(decoded.begin(), decoded.end(), undecoded);
+    if (blocks) {
+        blocks->stale = true;
+    }
 }
 
 void Chip8Cpu::load_rom(const std::filesystem::path& path)
@@ -308,41 +1072,361 @@ void Chip8Cpu::load_rom(const std::filesystem::path& path)
     }
 
     ifs.seekg(0, std::ios::end);
-    const auto bytes = ifs.tellg();
+    const auto bytes = static_cast<std::size_t>(ifs.tellg());
     ifs.seekg(0, std::ios::beg);
 
-    if (bytes > max_rom_size) {
+    if (bytes > m_memory_size - rom_start) {
         throw IOException("Size of loaded ROM exceeds max memory size");
     }
 
-    ifs.read(reinterpret_cast<char*>(memory) + 0x200, bytes);
+    m_rom_file.resize(bytes);
+    ifs.read(reinterpret_cast<char*>(m_rom_file.data()), static_cast<std::streamsize>(bytes));
+    load_rom(m_rom_file);
+}
+
+void Chip8Cpu::load_rom(utils::span<const std::uint8_t> rom)
+{
+    if (rom.size() > m_memory_size - rom_start) {
+        throw IOException("Size of loaded ROM exceeds max memory size");
+    }
+
+    // store() already drops the decoded instructions and blocks the ROM overwrote,
+    // everything outside of it is still valid
+    m_rom = rom;
+    store(rom_start, rom.data(), rom.size());
+}
+
+void Chip8Cpu::predecode(utils::span<const std::uint16_t> block_starts)
+{
+    if (blocks && blocks->stale) {
+        blocks->flush();
+    }
+
+    for (const auto start : block_starts) {
+        if (start >= m_memory_size - 1) {
+            continue;
+        }
+        if (blocks && blocks->entries[start].length == 0) {
+            build_block(start);
+        }
+
+        // the interpreter only caches even addresses
+        for (std::uint32_t addr = start, n = 0; addr < m_memory_size - 1 && n < max_block_length; addr += 2, n++) {
+            const auto ins = decode(fetch(addr), m_quirks);
+            if (!(addr & 1)) {
+                decoded[addr >> 1] = ins;
+            }
+            if (ends_block(ins.op)) {
+                break;
+            }
+        }
+    }
 }
 
 void Chip8Cpu::step()
 {
-    if (pc >= memory_size) {
-        throw IOException("Program counter exceeded memory size");
+    if (try_step() != Fault::none) {
+        throw_fault();
+    }
+}
+
+std::uint64_t Chip8Cpu::run(std::uint64_t cycles)
+{
+    return run_until(cycles, 0).cycles;
+}
+
+Chip8Cpu::RunResult Chip8Cpu::run_until(std::uint64_t cycles, std::uint8_t stop_on)
+{
+    const auto result = try_run_until(cycles, stop_on);
+    if (result.reason == StopReason::fault) {
+        throw_fault();
     }
+    return result;
+}
 
-    opcode = memory[pc];
-    opcode <<= 8;
-    opcode |= memory[pc + 1];
+Chip8Cpu::Fault Chip8Cpu::try_step() noexcept(runs_noexcept)
+{
+    m_fault = {};
+    m_events = 0;
+    if (pc >= m_memory_size - 1) {
+        m_fault = {Fault::pc_out_of_range, pc, 0};
+        return m_fault.fault;
+    }
 
-    instructions[(opcode & 0xF000) >> 12](*this);
+    if (pc & 1) {
+        const auto ins = decode(fetch(pc), m_quirks);
+        execute(ins);
+    } else {
+        const auto ins = decoded[pc >> 1];
+        execute(ins);
+    }
+    return m_fault.fault;
+}
+
+Chip8Cpu::RunResult Chip8Cpu::try_run(std::uint64_t cycles) noexcept(runs_noexcept)
+{
+    return try_run_until(cycles, 0);
+}
+
+Chip8Cpu::RunResult Chip8Cpu::try_run_until(std::uint64_t cycles, std::uint8_t stop_on) noexcept(runs_noexcept)
+{
+    m_fault = {};
+    m_events = 0;
+    // faults always stop, so the loop only has to test one byte after each instruction
+    const auto mask = static_cast<std::uint8_t>(stop_on | stop_on_fault);
+    if (m_engine == Engine::block) {
+        return run_blocks(cycles, mask);
+    }
+    if (m_engine == Engine::native && m_native) {
+        Native native{*this, mask};
+        return m_native(native, cycles);
+    }
+
+    const auto* cache = decoded.data();
+    std::uint64_t done = 0;
+    while (done < cycles) {
+        const auto addr = pc;
+        if (addr >= m_memory_size - 1) {
+            m_fault = {Fault::pc_out_of_range, addr, 0};
+            m_events |= stop_on_fault;
+            break;
+        }
+
+        const auto ins = (addr & 1) ? decode(fetch(addr), m_quirks) : cache[addr >> 1];
+        execute(ins);
+        if (m_events & mask) {
+            done += !(m_events & stop_on_fault);
+            break;
+        }
+        ++done;
+    }
+    return {done, m_fault.fault, stop_reason(m_events & mask)};
+}
+
+Chip8Cpu::RunResult Chip8Cpu::run_blocks(std::uint64_t cycles, std::uint8_t mask) noexcept(runs_noexcept)
+{
+    auto& cache = *blocks;
+    std::uint64_t done = 0;
+
+    while (done < cycles) {
+        if (cache.stale) {
+            cache.flush();
+        }
+
+        if (pc >= m_memory_size - 1) {
+            m_fault = {Fault::pc_out_of_range, pc, 0};
+            m_events |= stop_on_fault;
+            break;
+        }
+
+        if (cache.entries[pc].length == 0) {
+            build_block(pc);
+        }
+        const auto block = cache.entries[pc];
+
+        // a block may be cut short by the cycle budget, the next lookup then starts mid-block
+        const auto n = std::min<std::uint64_t>(block.length, cycles - done);
+        const auto* ins = cache.code.data() + block.offset;
+        for (std::uint64_t i = 0; i < n; i++) {
+            execute(ins[i]);
+            if (m_events & mask) {
+                done += i + !(m_events & stop_on_fault);
+                return {done, m_fault.fault, stop_reason(m_events & mask)};
+            }
+        }
+        done += n;
+    }
+
+    return {done, m_fault.fault, stop_reason(m_events & mask)};
+}
+
+void Chip8Cpu::build_block(std::uint16_t start)
+{
+    auto& cache = *blocks;
+    // overlapping blocks can fill the buffer, starting over beats growing it mid-run
+    if (cache.code.size() + max_block_length > cache.code.capacity()) {
+        cache.flush();
+    }
+    BlockCache::Entry block;
+    block.offset = static_cast<std::uint32_t>(cache.code.size());
+    for (std::uint32_t addr = start; addr < m_memory_size - 1 && block.length < max_block_length; addr += 2) {
+        const auto ins = decode(fetch(addr), m_quirks);
+        cache.code.push_back(ins);
+        cache.covered.set(addr);
+        cache.covered.set(addr + 1);
+        ++block.length;
+        if (ends_block(ins.op)) {
+            break;
+        }
+    }
+    cache.entries[start] = block;
+}
+
+Chip8Cpu::StopReason Chip8Cpu::stop_reason(std::uint8_t events) noexcept
+{
+    if (events & stop_on_fault) {
+        return StopReason::fault;
+    }
+    if (events & stop_on_key_wait) {
+        return StopReason::key_wait;
+    }
+    if (events & stop_on_exit) {
+        return StopReason::exit;
+    }
+    if (events & stop_on_draw) {
+        return StopReason::draw;
+    }
+    return StopReason::cycles;
+}
+
+void Chip8Cpu::raise(Fault fault, Instruction ins) noexcept
+{
+    m_fault = {fault, pc, ins.opcode};
+    m_events |= stop_on_fault;
+}
+
+void Chip8Cpu::throw_fault() const
+{
+    const auto x = (m_fault.opcode & 0x0F00) >> 8;
+    switch (m_fault.fault) {
+    case Fault::none:
+        break;
+    case Fault::invalid_opcode:
+        throw InterpreterException("Instruction {0:#X} is not a Chip8 opcode", m_fault.opcode);
+    case Fault::unsupported_opcode:
+        throw InterpreterException("Instruction 0x0NNN is unsupported");
+    case Fault::stack_overflow:
+        throw InterpreterException("Stack overflowed");
+    case Fault::stack_underflow:
+        throw InterpreterException("Stack underflowed");
+    case Fault::key_out_of_range:
+        throw InterpreterException("Key stored in register V[{0:d}] out of range", x);
+    case Fault::font_out_of_range:
+        throw InterpreterException("Character in register V[{0:d}] not representable", x);
+    case Fault::memory_out_of_range:
+        switch (m_fault.opcode & 0xF0FF) {
+        case 0xF055:
+            throw InterpreterException("Can't copy registers to memory: address register out of range");
+        case 0xF065:
+            throw InterpreterException("Can't copy memory to registers: address register out of range");
+        default:
+            throw InterpreterException("Instruction {0:#X} at {1:#X} accesses memory out of range", m_fault.opcode, m_fault.pc);
+        }
+    case Fault::pc_out_of_range:
+        throw IOException("Program counter exceeded memory size");
+    }
+    throw InterpreterException("Unknown fault");
 }
 
 void Chip8Cpu::clear_screen()
 {
-    std::fill_n(&gfx[0][0], screen_width * screen_height, 0);
+    clear_planes((1 << planes) - 1);
+}
+
+void Chip8Cpu::clear_planes(std::uint8_t mask)
+{
+    for (int p = 0; p < planes; p++) {
+        if (!(mask & (1 << p))) {
+            continue;
+        }
+        for (int y = 0; y < hires_height; y++) {
+            auto* row = gfx[p][y];
+            if (row[0] | row[1]) {
+                row[0] = row[1] = 0;
+                dirty_rows |= std::uint64_t{1} << y;
+            }
+        }
+    }
+    rehash_framebuffer();
+}
+
+void Chip8Cpu::scroll_vertical(int rows)
+{
+    const int height = this->height();
+    const int n = std::min(std::abs(rows), height);
+    for (int p = 0; p < planes; p++) {
+        if (!(m_plane_mask & (1 << p))) {
+            continue;
+        }
+        auto* plane = gfx[p];
+        if (rows > 0) {
+            std::memmove(plane + n, plane, (height - n) * sizeof(plane[0]));
+            std::memset(plane, 0, n * sizeof(plane[0]));
+        } else {
+            std::memmove(plane, plane + n, (height - n) * sizeof(plane[0]));
+            std::memset(plane + height - n, 0, n * sizeof(plane[0]));
+        }
+    }
+
+    rehash_framebuffer();
+    dirty_rows |= all_rows();
+    flags.draw = true;
+    m_events |= stop_on_draw;
+}
+
+void Chip8Cpu::scroll_horizontal(int pixels)
+{
+    const int n = std::abs(pixels);
+    for (int p = 0; p < planes; p++) {
+        if (!(m_plane_mask & (1 << p))) {
+            continue;
+        }
+        for (int y = 0; y < height(); y++) {
+            auto* row = gfx[p][y];
+            if (!m_hires) {
+                row[0] = pixels > 0 ? row[0] >> n : row[0] << n;
+            } else if (pixels > 0) {
+                row[1] = (row[1] >> n) | (row[0] << (64 - n));
+                row[0] >>= n;
+            } else {
+                row[0] = (row[0] << n) | (row[1] >> (64 - n));
+                row[1] <<= n;
+            }
+        }
+    }
+
+    rehash_framebuffer();
+    dirty_rows |= all_rows();
+    flags.draw = true;
+    m_events |= stop_on_draw;
+}
+
+void Chip8Cpu::set_hires(bool hires)
+{
+    m_hires = hires;
+    clear_screen();
+    dirty_rows |= all_rows();
+    flags.draw = true;
+    m_events |= stop_on_draw;
 }
 
 void Chip8Cpu::reset()
 {
+    // whatever the last run wrote would make the next one diverge from a freshly loaded machine
+    std::fill(memory.begin(), memory.end(), 0);
+    std::copy(chip8_fontset.begin(), chip8_fontset.end(), memory.begin());
+    std::copy(big_fontset.begin(), big_fontset.end(), memory.begin() + big_font_start);
+    std::copy_n(m_rom.begin(), std::min<std::size_t>(m_rom.size(), m_memory_size - rom_start), memory.begin() + rom_start);
+    rehash_memory();
+    invalidate_all();
+
     clear_screen();
-    pc = 0x200;
+    m_hires = false;
+    m_plane_mask = 1;
+    m_pitch = 64;
+    m_custom_audio = false;
+    std::fill_n(m_audio_pattern, audio_pattern_size, 0);
+    pc = rom_start;
     I = 0;
+    sp = 0;
+    std::fill_n(stack, stack_size, 0);
+    std::fill_n(V, reg_size, 0);
+    std::fill_n(keys, keys_size, 0);
     delay_timer = 0;
     sound_timer = 0;
+    m_fault = {};
+    m_events = 0;
+    flags = {};
 }
 
 void Chip8Cpu::count_down()
@@ -352,10 +1436,6 @@ void Chip8Cpu::count_down()
     }
 
     if (sound_timer > 0) {
-        if (sound_timer == 1) {
-            fmt::print("BEEP\a");
-            std::fflush(stdout);
-        }
         --sound_timer;
     }
 }
@@ -0,0 +1,247 @@
+#include "chip8.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+
+constexpr std::uint8_t state_magic[4] = {'C', '8', 'S', 'T'};
+constexpr std::uint8_t state_version = 1;
+
+// granularity at which restore() compares and copies memory
+constexpr std::uint16_t restore_page_size = 64;
+
+class StateWriter
+{
+public:
+    explicit StateWriter(std::vector<std::uint8_t>& out)
+        : m_out(out) {}
+
+    void bytes(const std::uint8_t* data, std::size_t size)
+    {
+        m_out.insert(m_out.end(), data, data + size);
+    }
+
+    template <class Int>
+    void value(Int v)
+    {
+        for (std::size_t i = 0; i < sizeof(Int); i++) {
+            m_out.push_back(static_cast<std::uint8_t>(v >> (8 * i)));
+        }
+    }
+
+private:
+    std::vector<std::uint8_t>& m_out;
+};
+
+class StateReader
+{
+public:
+    explicit StateReader(utils::span<const std::uint8_t> in)
+        : m_in(in) {}
+
+    void bytes(std::uint8_t* data, std::size_t size)
+    {
+        require(size);
+        std::memcpy(data, m_in.data() + m_pos, size);
+        m_pos += size;
+    }
+
+    template <class Int>
+    Int value()
+    {
+        require(sizeof(Int));
+        Int v = 0;
+        for (std::size_t i = 0; i < sizeof(Int); i++) {
+            v |= static_cast<Int>(Int{m_in[m_pos++]} << (8 * i));
+        }
+        return v;
+    }
+
+private:
+    void require(std::size_t size) const
+    {
+        if (m_in.size() - m_pos < size) {
+            throw IOException("Saved state is truncated");
+        }
+    }
+
+    utils::span<const std::uint8_t> m_in;
+    std::size_t m_pos = 0;
+};
+
+}
+
+Chip8Cpu::State Chip8Cpu::snapshot() const
+{
+    State state;
+    state.I = I;
+    state.pc = pc;
+    std::copy_n(stack, stack_size, state.stack);
+    state.sp = sp;
+    std::copy_n(V, reg_size, state.V);
+    state.delay_timer = delay_timer;
+    state.sound_timer = sound_timer;
+    std::copy_n(keys, keys_size, state.keys);
+    state.rng = rng.state();
+    state.hires = m_hires;
+    state.plane_mask = m_plane_mask;
+    state.pitch = m_pitch;
+    state.custom_audio = m_custom_audio;
+    std::copy_n(m_audio_pattern, audio_pattern_size, state.audio_pattern);
+    std::copy_n(rpl, flags_size, state.rpl);
+    std::memcpy(state.gfx, gfx, sizeof(gfx));
+    state.memory.assign(memory.begin(), memory.end());
+    return state;
+}
+
+void Chip8Cpu::restore(const State& state)
+{
+    if (state.memory.size() != m_memory_size) {
+        throw InterpreterException("State has {} bytes of memory, the machine has {}", state.memory.size(), m_memory_size);
+    }
+
+    I = state.I;
+    pc = state.pc;
+    std::copy_n(state.stack, stack_size, stack);
+    sp = state.sp;
+    std::copy_n(state.V, reg_size, V);
+    delay_timer = state.delay_timer;
+    sound_timer = state.sound_timer;
+    std::copy_n(state.keys, keys_size, keys);
+    rng.set_state(state.rng);
+    m_plane_mask = state.plane_mask;
+    m_pitch = state.pitch;
+    m_custom_audio = state.custom_audio;
+    std::copy_n(state.audio_pattern, audio_pattern_size, m_audio_pattern);
+    std::copy_n(state.rpl, flags_size, rpl);
+    if (m_hires != state.hires) {
+        m_hires = state.hires;
+        dirty_rows |= all_rows();
+    }
+    for (int p = 0; p < planes; p++) {
+        for (int y = 0; y < hires_height; y++) {
+            if (std::memcmp(gfx[p][y], state.gfx[p][y], sizeof(gfx[p][y])) != 0) {
+                std::memcpy(gfx[p][y], state.gfx[p][y], sizeof(gfx[p][y]));
+                dirty_rows |= std::uint64_t{1} << y;
+            }
+        }
+    }
+    rehash_framebuffer();
+
+    // branching from a snapshot rarely touches more than a few pages, so leave the
+    // others and their decoded instructions alone
+    for (std::uint32_t page = 0; page < m_memory_size; page += restore_page_size) {
+        if (std::memcmp(memory.data() + page, state.memory.data() + page, restore_page_size) != 0) {
+            store(page, state.memory.data() + page, restore_page_size);
+        }
+    }
+
+    flags.cls = false;
+    flags.draw = true;
+}
+
+void Chip8Cpu::reset(const State& state)
+{
+    restore(state);
+    dirty_rows = all_rows();
+    m_fault = {};
+    m_events = 0;
+    flags = {};
+}
+
+std::vector<std::uint8_t> Chip8Cpu::save_state() const
+{
+    std::vector<std::uint8_t> out;
+    out.reserve(sizeof(State) + m_memory_size + sizeof(state_magic) + 5);
+
+    StateWriter w{out};
+    w.bytes(state_magic, sizeof(state_magic));
+    w.value(state_version);
+    w.value(I);
+    w.value(pc);
+    for (auto addr : stack) {
+        w.value(addr);
+    }
+    w.value(sp);
+    w.bytes(V, reg_size);
+    w.value(delay_timer);
+    w.value(sound_timer);
+    w.bytes(keys, keys_size);
+    for (auto word : rng.state()) {
+        w.value(word);
+    }
+    w.value(static_cast<std::uint8_t>(m_hires));
+    w.value(m_plane_mask);
+    w.value(m_pitch);
+    w.value(static_cast<std::uint8_t>(m_custom_audio));
+    w.bytes(m_audio_pattern, audio_pattern_size);
+    w.bytes(rpl, flags_size);
+    for (const auto& plane : gfx) {
+        for (const auto& row : plane) {
+            for (auto word : row) {
+                w.value(word);
+            }
+        }
+    }
+    w.value(m_memory_size);
+    w.bytes(memory.data(), m_memory_size);
+    return out;
+}
+
+void Chip8Cpu::load_state(utils::span<const std::uint8_t> data)
+{
+    StateReader r{data};
+
+    std::uint8_t magic[sizeof(state_magic)];
+    r.bytes(magic, sizeof(magic));
+    if (!std::equal(magic, magic + sizeof(magic), state_magic)) {
+        throw IOException("Data is not a saved Chip8 state");
+    }
+
+    const auto version = r.value<std::uint8_t>();
+    if (version != state_version) {
+        throw IOException("Unsupported saved state version {}", version);
+    }
+
+    State state;
+    state.I = r.value<std::uint16_t>();
+    state.pc = r.value<std::uint16_t>();
+    for (auto& addr : state.stack) {
+        addr = r.value<std::uint16_t>();
+    }
+    state.sp = r.value<std::uint8_t>();
+    r.bytes(state.V, reg_size);
+    state.delay_timer = r.value<std::uint8_t>();
+    state.sound_timer = r.value<std::uint8_t>();
+    r.bytes(state.keys, keys_size);
+    for (auto& word : state.rng) {
+        word = r.value<std::uint32_t>();
+    }
+    state.hires = r.value<std::uint8_t>() != 0;
+    state.plane_mask = r.value<std::uint8_t>() & 0x3;
+    state.pitch = r.value<std::uint8_t>();
+    state.custom_audio = r.value<std::uint8_t>() != 0;
+    r.bytes(state.audio_pattern, audio_pattern_size);
+    r.bytes(state.rpl, flags_size);
+    for (auto& plane : state.gfx) {
+        for (auto& row : plane) {
+            for (auto& word : row) {
+                word = r.value<std::uint64_t>();
+            }
+        }
+    }
+    const auto size = r.value<std::uint32_t>();
+    if (size != m_memory_size) {
+        throw IOException("Saved state has {} bytes of memory, the machine has {}", size, m_memory_size);
+    }
+    state.memory.resize(size);
+    r.bytes(state.memory.data(), size);
+
+    if (state.sp > stack_size) {
+        throw IOException("Saved state has an invalid stack pointer");
+    }
+
+    restore(state);
+}
@@ -0,0 +1,345 @@
+#include "code_map.h"
+
+#include <algorithm>
+#include <set>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+namespace
+{
+
+using Operation = Chip8Cpu::Operation;
+
+bool is_skip(Operation op)
+{
+    switch (op) {
+    case Operation::se_imm:
+    case Operation::sne_imm:
+    case Operation::se_reg:
+    case Operation::sne_reg:
+    case Operation::skp:
+    case Operation::sknp:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// instructions after which control doesn't simply go on with the next one
+bool ends_flow(Operation op)
+{
+    switch (op) {
+    case Operation::jp:
+    case Operation::call:
+    case Operation::ret:
+    case Operation::exit:
+    case Operation::jp_v0:
+    case Operation::sys:
+    case Operation::invalid:
+        return true;
+    default:
+        return is_skip(op);
+    }
+}
+
+// unreached bytes per line of the listing
+constexpr std::uint32_t data_per_line = 8;
+
+}
+
+CodeMap::CodeMap(const Chip8Cpu& chip8)
+    : CodeMap(chip8.memory_view(), chip8.quirks())
+{
+}
+
+CodeMap::CodeMap(utils::span<const std::uint8_t> memory, Chip8Cpu::Quirks quirks, std::uint16_t entry)
+    : m_memory(memory.begin(), memory.end()), m_quirks(quirks), m_entry(entry), m_bytes(memory.size(), Byte::unknown)
+{
+    const auto size = static_cast<std::uint32_t>(m_memory.size());
+    std::vector<bool> leader(size);
+    std::vector<std::uint32_t> pending;
+    std::set<std::uint16_t> subroutines;
+    std::set<std::uint16_t> data_refs;
+
+    const auto branch_to = [&](std::uint32_t target) {
+        if (target + 1 < size) {
+            leader[target] = true;
+            pending.push_back(target);
+        }
+    };
+
+    // follow every path once, marking the instructions on the way
+    branch_to(entry);
+    while (!pending.empty()) {
+        auto addr = pending.back();
+        pending.pop_back();
+
+        while (addr + 1 < size) {
+            if (m_bytes[addr] == Byte::code) {
+                // joined a path that was already walked, a block starts here
+                leader[addr] = true;
+                break;
+            }
+
+            const auto length = length_at(addr);
+            if (addr + length > size) {
+                break;
+            }
+            m_bytes[addr] = Byte::code;
+            for (std::uint32_t i = 1; i < length; i++) {
+                if (m_bytes[addr + i] == Byte::unknown) {
+                    m_bytes[addr + i] = Byte::operand;
+                }
+            }
+
+            const auto ins = Chip8Cpu::decode(opcode_at(addr), quirks);
+            const auto next = addr + length;
+            if (ins.op == Operation::ld_i) {
+                data_refs.insert(ins.nnn());
+            } else if (ins.op == Operation::ld_i_long) {
+                data_refs.insert(opcode_at(addr + 2));
+            } else if (ins.op == Operation::jp) {
+                branch_to(ins.nnn());
+            } else if (ins.op == Operation::call) {
+                subroutines.insert(ins.nnn());
+                branch_to(ins.nnn());
+                branch_to(next);
+            } else if (is_skip(ins.op)) {
+                branch_to(next);
+                if (next + 1 < size) {
+                    branch_to(next + length_at(next));
+                }
+            }
+            if (ends_flow(ins.op)) {
+                break;
+            }
+            addr = next;
+        }
+    }
+
+    // cut the marked instructions into blocks at every leader and every change of flow
+    std::vector<std::uint32_t> block_index(size, ~0u);
+    for (std::uint32_t start = 0; start < size; start++) {
+        if (!leader[start] || m_bytes[start] != Byte::code) {
+            continue;
+        }
+
+        Block block{static_cast<std::uint16_t>(start), 0, {}, std::nullopt, false};
+        auto addr = start;
+        for (;;) {
+            const auto ins = Chip8Cpu::decode(opcode_at(addr), quirks);
+            const auto next = addr + length_at(addr);
+            if (ins.op == Operation::jp) {
+                block.successors.push_back(ins.nnn());
+            } else if (ins.op == Operation::call) {
+                block.callee = ins.nnn();
+                block.successors.push_back(static_cast<std::uint16_t>(next));
+            } else if (is_skip(ins.op)) {
+                block.successors.push_back(static_cast<std::uint16_t>(next));
+                if (next + 1 < size) {
+                    block.successors.push_back(static_cast<std::uint16_t>(next + length_at(next)));
+                }
+            } else if (ins.op == Operation::jp_v0) {
+                block.indirect = true;
+            } else if (!ends_flow(ins.op) && next < size && m_bytes[next] == Byte::code && leader[next]) {
+                block.successors.push_back(static_cast<std::uint16_t>(next));
+            }
+
+            if (ends_flow(ins.op) || next >= size || m_bytes[next] != Byte::code || leader[next]) {
+                block.end = static_cast<std::uint16_t>(std::min(next, size - 1));
+                break;
+            }
+            addr = next;
+        }
+
+        // targets past the end of memory aren't blocks
+        block.successors.erase(std::remove_if(block.successors.begin(), block.successors.end(), [&](std::uint16_t a) {
+            return a + 1u >= size;
+        }), block.successors.end());
+
+        block_index[start] = static_cast<std::uint32_t>(m_blocks.size());
+        m_blocks.push_back(std::move(block));
+    }
+
+    m_subroutines.assign(subroutines.begin(), subroutines.end());
+    m_data_refs.assign(data_refs.begin(), data_refs.end());
+
+    // the calls made by the blocks each subroutine reaches without calling
+    std::vector<std::uint16_t> functions{entry};
+    functions.insert(functions.end(), m_subroutines.begin(), m_subroutines.end());
+    for (const auto function : functions) {
+        std::set<std::uint16_t> callees;
+        std::vector<bool> visited(m_blocks.size());
+        std::vector<std::uint32_t> stack;
+        if (function + 1u < size && block_index[function] != ~0u) {
+            stack.push_back(block_index[function]);
+        }
+        while (!stack.empty()) {
+            const auto i = stack.back();
+            stack.pop_back();
+            if (visited[i]) {
+                continue;
+            }
+            visited[i] = true;
+
+            const auto& block = m_blocks[i];
+            if (block.callee) {
+                callees.insert(*block.callee);
+            }
+            for (const auto s : block.successors) {
+                if (block_index[s] != ~0u) {
+                    stack.push_back(block_index[s]);
+                }
+            }
+        }
+        for (const auto callee : callees) {
+            m_calls.push_back({function, callee});
+        }
+    }
+}
+
+const CodeMap::Block* CodeMap::block_at(std::uint16_t start) const noexcept
+{
+    const auto it = std::lower_bound(m_blocks.begin(), m_blocks.end(), start, [](const Block& b, std::uint16_t a) {
+        return b.start < a;
+    });
+    return it != m_blocks.end() && it->start == start ? &*it : nullptr;
+}
+
+std::vector<std::uint16_t> CodeMap::block_starts() const
+{
+    std::vector<std::uint16_t> starts;
+    starts.reserve(m_blocks.size());
+    for (const auto& block : m_blocks) {
+        starts.push_back(block.start);
+    }
+    return starts;
+}
+
+std::uint16_t CodeMap::opcode_at(std::uint32_t addr) const noexcept
+{
+    if (addr + 1 >= m_memory.size()) {
+        return 0;
+    }
+    return static_cast<std::uint16_t>(m_memory[addr] << 8 | m_memory[addr + 1]);
+}
+
+std::uint32_t CodeMap::length_at(std::uint32_t addr) const noexcept
+{
+    // only F000 NNNN is longer than one word
+    return Chip8Cpu::decode(opcode_at(addr), m_quirks).op == Operation::ld_i_long ? 4 : 2;
+}
+
+void CodeMap::write_listing(std::ostream& out) const
+{
+    const auto size = static_cast<std::uint32_t>(m_memory.size());
+    const auto is_subroutine = [&](std::uint32_t addr) {
+        return std::binary_search(m_subroutines.begin(), m_subroutines.end(), addr);
+    };
+    const auto is_data = [&](std::uint32_t addr) {
+        return std::binary_search(m_data_refs.begin(), m_data_refs.end(), addr);
+    };
+
+    // trailing zeros are just unused memory
+    auto end = size;
+    while (end > m_entry && m_bytes[end - 1] == Byte::unknown && m_memory[end - 1] == 0) {
+        end--;
+    }
+
+    for (std::uint32_t addr = m_entry; addr < end;) {
+        if (addr == m_entry) {
+            fmt::print(out, "entry_{:04x}:\n", addr);
+        } else if (is_subroutine(addr)) {
+            fmt::print(out, "\nsub_{:04x}:\n", addr);
+        } else if (block_at(static_cast<std::uint16_t>(addr))) {
+            fmt::print(out, "label_{:04x}:\n", addr);
+        }
+        if (is_data(addr)) {
+            fmt::print(out, "data_{:04x}:\n", addr);
+        }
+
+        if (m_bytes[addr] == Byte::code) {
+            const auto length = length_at(addr);
+            const auto opcode = opcode_at(addr);
+            const auto next = length > 2 ? opcode_at(addr + 2) : std::uint16_t{0};
+            const auto bytes = length > 2 ? fmt::format("{:04x} {:04x}", opcode, next) : fmt::format("{:04x}", opcode);
+            fmt::print(out, "    {:04x}  {:<10} {}\n", addr, bytes, disassemble(opcode, m_quirks, next));
+            addr += length;
+            continue;
+        }
+
+        // a run of data up to the next labelled or reached address
+        std::string bytes;
+        auto a = addr;
+        do {
+            bytes += fmt::format("{}{:#04x}", a == addr ? "" : ", ", m_memory[a]);
+            a++;
+        } while (a < end && a - addr < data_per_line && m_bytes[a] != Byte::code && !is_data(a));
+        fmt::print(out, "    {:04x}  {:<10} db {}\n", addr, "", bytes);
+        addr = a;
+    }
+}
+
+std::string CodeMap::disassemble(std::uint16_t opcode, Chip8Cpu::Quirks quirks, std::uint16_t next)
+{
+    const auto ins = Chip8Cpu::decode(opcode, quirks);
+    const auto x = ins.x;
+    const auto y = ins.y;
+    switch (ins.op) {
+    case Operation::invalid: return fmt::format("dw {:#06x}", opcode);
+    case Operation::sys: return fmt::format("SYS {:#05x}", ins.nnn());
+    case Operation::cls: return "CLS";
+    case Operation::ret: return "RET";
+    case Operation::scroll_down: return fmt::format("SCD {}", opcode & 0xF);
+    case Operation::scroll_up: return fmt::format("SCU {}", opcode & 0xF);
+    case Operation::scroll_right: return "SCR";
+    case Operation::scroll_left: return "SCL";
+    case Operation::exit: return "EXIT";
+    case Operation::lores: return "LOW";
+    case Operation::hires: return "HIGH";
+    case Operation::jp: return fmt::format("JP {:#05x}", ins.nnn());
+    case Operation::call: return fmt::format("CALL {:#05x}", ins.nnn());
+    case Operation::se_imm: return fmt::format("SE V{:X}, {:#04x}", x, ins.nn);
+    case Operation::sne_imm: return fmt::format("SNE V{:X}, {:#04x}", x, ins.nn);
+    case Operation::se_reg: return fmt::format("SE V{:X}, V{:X}", x, y);
+    case Operation::save_range: return fmt::format("SAVE V{:X} - V{:X}", x, y);
+    case Operation::load_range: return fmt::format("LOAD V{:X} - V{:X}", x, y);
+    case Operation::ld_imm: return fmt::format("LD V{:X}, {:#04x}", x, ins.nn);
+    case Operation::add_imm: return fmt::format("ADD V{:X}, {:#04x}", x, ins.nn);
+    case Operation::ld_reg: return fmt::format("LD V{:X}, V{:X}", x, y);
+    case Operation::or_reg: return fmt::format("OR V{:X}, V{:X}", x, y);
+    case Operation::and_reg: return fmt::format("AND V{:X}, V{:X}", x, y);
+    case Operation::xor_reg: return fmt::format("XOR V{:X}, V{:X}", x, y);
+    case Operation::add_reg: return fmt::format("ADD V{:X}, V{:X}", x, y);
+    case Operation::sub_reg: return fmt::format("SUB V{:X}, V{:X}", x, y);
+    case Operation::shr: return fmt::format("SHR V{:X}, V{:X}", x, y);
+    case Operation::subn_reg: return fmt::format("SUBN V{:X}, V{:X}", x, y);
+    case Operation::shl: return fmt::format("SHL V{:X}, V{:X}", x, y);
+    case Operation::sne_reg: return fmt::format("SNE V{:X}, V{:X}", x, y);
+    case Operation::ld_i: return fmt::format("LD I, {:#05x}", ins.nnn());
+    case Operation::jp_v0: return fmt::format("JP V0, {:#05x}", ins.nnn());
+    case Operation::rnd: return fmt::format("RND V{:X}, {:#04x}", x, ins.nn);
+    case Operation::drw: return fmt::format("DRW V{:X}, V{:X}, {}", x, y, opcode & 0xF);
+    case Operation::skp: return fmt::format("SKP V{:X}", x);
+    case Operation::sknp: return fmt::format("SKNP V{:X}", x);
+    case Operation::ld_i_long: return fmt::format("LD I, {:#06x}", next);
+    case Operation::plane: return fmt::format("PLANE {}", (opcode >> 8) & 0xF);
+    case Operation::audio: return "AUDIO";
+    case Operation::ld_vx_dt: return fmt::format("LD V{:X}, DT", x);
+    case Operation::ld_key: return fmt::format("LD V{:X}, K", x);
+    case Operation::ld_dt: return fmt::format("LD DT, V{:X}", x);
+    case Operation::ld_st: return fmt::format("LD ST, V{:X}", x);
+    case Operation::add_i: return fmt::format("ADD I, V{:X}", x);
+    case Operation::ld_font: return fmt::format("LD F, V{:X}", x);
+    case Operation::ld_hifont: return fmt::format("LD HF, V{:X}", x);
+    case Operation::ld_bcd: return fmt::format("LD B, V{:X}", x);
+    case Operation::pitch: return fmt::format("PITCH V{:X}", x);
+    case Operation::ld_store: return fmt::format("LD [I], V{:X}", x);
+    case Operation::ld_load: return fmt::format("LD V{:X}, [I]", x);
+    case Operation::save_flags: return fmt::format("LD R, V{:X}", x);
+    case Operation::load_flags: return fmt::format("LD V{:X}, R", x);
+    case Operation::count: break;
+    }
+    return fmt::format("dw {:#06x}", opcode);
+}
@@ -0,0 +1,130 @@
+#include "machine_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+
+struct Task
+{
+    std::size_t machine;
+    std::uint64_t frames_left;
+};
+
+// the owner pushes and pops at the back, thieves take from the front
+class WorkQueue
+{
+public:
+    void push(Task task)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_tasks.push_back(task);
+    }
+
+    bool pop(Task& task)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = m_tasks.back();
+        m_tasks.pop_back();
+        return true;
+    }
+
+    bool steal(Task& task)
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        if (m_tasks.empty()) {
+            return false;
+        }
+        task = m_tasks.front();
+        m_tasks.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex m_mutex;
+    std::deque<Task> m_tasks;
+};
+
+}
+
+MachinePool::MachinePool(unsigned threads)
+    : m_threads(std::max(threads, 1u))
+{
+}
+
+std::size_t MachinePool::add(Chip8Cpu&& machine)
+{
+    m_machines.push_back(std::move(machine));
+    m_status.emplace_back();
+    return m_machines.size() - 1;
+}
+
+void MachinePool::run(std::uint64_t frames, std::uint64_t cycles_per_frame, std::uint64_t frames_per_slice)
+{
+    frames_per_slice = std::max<std::uint64_t>(frames_per_slice, 1);
+
+    const auto workers = static_cast<unsigned>(std::min<std::size_t>(m_threads, std::max<std::size_t>(m_machines.size(), 1)));
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    for (unsigned i = 0; i < workers; i++) {
+        queues.push_back(std::make_unique<WorkQueue>());
+    }
+
+    std::atomic<std::size_t> pending{0};
+    for (std::size_t i = 0; i < m_machines.size(); i++) {
+        if (!m_status[i].faulted && frames > 0) {
+            queues[i % workers]->push({i, frames});
+            ++pending;
+        }
+    }
+
+    auto work = [&](unsigned self) {
+        Task task;
+        while (pending.load(std::memory_order_acquire) > 0) {
+            bool found = queues[self]->pop(task);
+            for (unsigned i = 1; !found && i < workers; i++) {
+                found = queues[(self + i) % workers]->steal(task);
+            }
+            if (!found) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            auto& machine = m_machines[task.machine];
+            auto& status = m_status[task.machine];
+            const auto slice = std::min(task.frames_left, frames_per_slice);
+            for (std::uint64_t f = 0; f < slice; f++) {
+                // a machine waiting for a key or halted by 00FD idles for the rest of the frame
+                if (machine.try_run_until(cycles_per_frame, Chip8Cpu::stop_on_key_wait | Chip8Cpu::stop_on_exit).fault != Chip8Cpu::Fault::none) {
+                    status.faulted = true;
+                    status.fault = machine.last_fault();
+                    break;
+                }
+                machine.count_down();
+                ++status.frames;
+            }
+            task.frames_left = status.faulted ? 0 : task.frames_left - slice;
+
+            if (task.frames_left > 0) {
+                queues[self]->push(task);
+            } else {
+                pending.fetch_sub(1, std::memory_order_release);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < workers; i++) {
+        threads.emplace_back(work, i);
+    }
+    work(0);
+    for (auto& t : threads) {
+        t.join();
+    }
+}
@@ -0,0 +1,183 @@
+#include "movie.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "rom_library.h"
+
+namespace
+{
+
+constexpr char movie_magic[4] = {'C', '8', 'M', 'V'};
+constexpr std::uint8_t movie_version = 1;
+constexpr std::size_t header_size = sizeof(movie_magic) + 1 + 4 + 4 + 8 + 1;
+
+// after the header every record is a varint cycle delta followed by one byte:
+// the key in the low nibble and the down flag in bit 4, or end_of_movie
+constexpr std::uint8_t key_down_bit = 0x10;
+constexpr std::uint8_t end_of_movie = 0xFF;
+
+template <class Int>
+void put_value(std::ostream& out, Int v)
+{
+    for (std::size_t i = 0; i < sizeof(Int); i++) {
+        out.put(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+template <class Int>
+Int get_value(const std::uint8_t* in)
+{
+    Int v = 0;
+    for (std::size_t i = 0; i < sizeof(Int); i++) {
+        v |= static_cast<Int>(Int{in[i]} << (8 * i));
+    }
+    return v;
+}
+
+std::vector<std::uint8_t> read_file(const std::filesystem::path& path)
+{
+    namespace fs = std::filesystem;
+
+    if (!fs::exists(path) || !fs::is_regular_file(path)) {
+        throw FileNotFoundException(path.u8string());
+    }
+
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        throw IOException("Can't read file " + path.u8string());
+    }
+    return {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+}
+
+}
+
+Movie Movie::load(const std::filesystem::path& path)
+{
+    const auto data = read_file(path);
+    if (data.size() < sizeof(movie_magic) + 1 || !std::equal(movie_magic, movie_magic + sizeof(movie_magic), data.begin())) {
+        throw IOException("File {} is not a Chip8 movie", path.u8string());
+    }
+
+    const auto* in = data.data() + sizeof(movie_magic);
+    const auto version = *in++;
+    if (version != movie_version) {
+        throw IOException("Unsupported movie version {}", version);
+    }
+    if (data.size() < header_size) {
+        throw IOException("Movie {} is truncated", path.u8string());
+    }
+
+    Movie movie;
+    movie.seed = get_value<std::uint32_t>(in);
+    movie.rate = get_value<std::uint32_t>(in + 4);
+    movie.rom_hash = get_value<std::uint64_t>(in + 8);
+    in += 16;
+    if (*in > static_cast<std::uint8_t>(Chip8Cpu::Quirks::xochip)) {
+        throw IOException("Movie {} uses unknown quirks", path.u8string());
+    }
+    movie.quirks = static_cast<Chip8Cpu::Quirks>(*in++);
+
+    // a recording that got interrupted may end in the middle of a record, drop that one
+    const auto* end = data.data() + data.size();
+    std::uint64_t cycle = 0;
+    while (in < end) {
+        std::uint64_t delta = 0;
+        int shift = 0;
+        while (in < end && (*in & 0x80) && shift < 63) {
+            delta |= std::uint64_t{*in++ & 0x7Fu} << shift;
+            shift += 7;
+        }
+        if (end - in < 2) {
+            break;
+        }
+        delta |= std::uint64_t{*in++} << shift;
+        cycle += delta;
+
+        const auto code = *in++;
+        if (code == end_of_movie) {
+            movie.length = cycle;
+            break;
+        }
+        if (code & ~(key_down_bit | 0x0F)) {
+            throw IOException("Corrupt event in movie {}", path.u8string());
+        }
+        movie.events.push_back({cycle, static_cast<std::uint8_t>(code & 0x0F), (code & key_down_bit) != 0});
+    }
+
+    return movie;
+}
+
+std::uint64_t rom_hash(const std::filesystem::path& path)
+{
+    const auto data = read_file(path);
+    return content_hash(data);
+}
+
+MovieRecorder::MovieRecorder(const std::filesystem::path& path, std::uint32_t seed, std::uint32_t rate, Chip8Cpu::Quirks quirks, std::uint64_t rom_hash)
+    : m_out(path, std::ios::out | std::ios::binary | std::ios::trunc)
+{
+    if (!m_out) {
+        throw IOException("Can't write file " + path.u8string());
+    }
+
+    m_out.write(movie_magic, sizeof(movie_magic));
+    m_out.put(static_cast<char>(movie_version));
+    put_value(m_out, seed);
+    put_value(m_out, rate);
+    put_value(m_out, rom_hash);
+    m_out.put(static_cast<char>(quirks));
+    m_out.flush();
+}
+
+MovieRecorder::~MovieRecorder() = default;
+
+void MovieRecorder::record(const KeyEvent& event)
+{
+    if (m_finished || event.cycle < m_last || event.key >= Chip8Cpu::keys_size) {
+        throw IOException("Key event can't be recorded");
+    }
+
+    write_delta(event.cycle);
+    m_out.put(static_cast<char>(event.key | (event.down ? key_down_bit : 0)));
+    // key changes are rare next to instructions, keeping the file current costs nothing
+    m_out.flush();
+}
+
+void MovieRecorder::finish(std::uint64_t cycle)
+{
+    if (m_finished) {
+        return;
+    }
+
+    write_delta(std::max(cycle, m_last));
+    m_out.put(static_cast<char>(end_of_movie));
+    m_out.flush();
+    m_finished = true;
+}
+
+void MovieRecorder::write_delta(std::uint64_t cycle)
+{
+    auto delta = cycle - m_last;
+    while (delta >= 0x80) {
+        m_out.put(static_cast<char>(delta | 0x80));
+        delta >>= 7;
+    }
+    m_out.put(static_cast<char>(delta));
+    m_last = cycle;
+}
+
+MoviePlayer::MoviePlayer(Scheduler& scheduler, std::vector<KeyEvent> events)
+    : m_scheduler(scheduler), m_events(std::move(events))
+{
+    std::stable_sort(m_events.begin(), m_events.end(), [](const KeyEvent& a, const KeyEvent& b) {
+        return a.cycle < b.cycle;
+    });
+}
+
+void MoviePlayer::run(std::uint64_t total)
+{
+    const auto now = m_scheduler.cycles();
+    const utils::span<const KeyEvent> pending{m_events.data() + m_next, m_events.size() - m_next};
+    m_next += m_scheduler.run_events(total > now ? total - now : 0, pending);
+}
@@ -0,0 +1,204 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <numeric>
+#include <string>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+namespace
+{
+
+constexpr std::uint16_t entry_point = 0x200;
+
+constexpr const char* operation_names[] = {
+    "invalid",
+    "0NNN sys",
+    "00E0 cls",
+    "00EE ret",
+    "00CN scd",
+    "00DN scu",
+    "00FB scr",
+    "00FC scl",
+    "00FD exit",
+    "00FE low",
+    "00FF high",
+    "1NNN jp",
+    "2NNN call",
+    "3XNN se",
+    "4XNN sne",
+    "5XY0 se",
+    "5XY2 save",
+    "5XY3 load",
+    "6XNN ld",
+    "7XNN add",
+    "8XY0 ld",
+    "8XY1 or",
+    "8XY2 and",
+    "8XY3 xor",
+    "8XY4 add",
+    "8XY5 sub",
+    "8XY6 shr",
+    "8XY7 subn",
+    "8XYE shl",
+    "9XY0 sne",
+    "ANNN ld I",
+    "BNNN jp V0",
+    "CXNN rnd",
+    "DXYN drw",
+    "EX9E skp",
+    "EXA1 sknp",
+    "F000 ld I long",
+    "FN01 plane",
+    "F002 audio",
+    "FX07 ld DT",
+    "FX0A ld K",
+    "FX15 ld DT",
+    "FX18 ld ST",
+    "FX1E add I",
+    "FX29 ld F",
+    "FX30 ld HF",
+    "FX33 ld B",
+    "FX3A pitch",
+    "FX55 ld [I]",
+    "FX65 ld [I]",
+    "FX75 ld R",
+    "FX85 ld R",
+};
+static_assert(std::size(operation_names) == static_cast<std::size_t>(Chip8Cpu::Operation::count));
+
+double percent(std::uint64_t part, std::uint64_t total)
+{
+    return total ? 100.0 * part / total : 0.0;
+}
+
+}
+
+Profiler::Profiler()
+{
+    reset();
+}
+
+void Profiler::reset()
+{
+    m_instructions = 0;
+    m_op_counts.fill(0);
+    m_op_times.fill({});
+    m_pc_counts.fill(0);
+    m_frames.assign(1, Frame{entry_point, 0, 0, {}});
+    m_current = 0;
+    m_edges.clear();
+}
+
+const char* Profiler::name(Operation op)
+{
+    return operation_names[static_cast<std::size_t>(op)];
+}
+
+void Profiler::record(std::uint16_t addr, Operation op, std::uint16_t opcode, std::chrono::nanoseconds elapsed, bool completed)
+{
+    ++m_instructions;
+    ++m_op_counts[static_cast<std::size_t>(op)];
+    ++m_pc_counts[addr];
+    m_op_times[static_cast<std::size_t>(op)] += elapsed;
+    ++m_frames[m_current].self;
+
+    if (!completed) {
+        return;
+    }
+
+    if (op == Operation::call) {
+        const auto callee = static_cast<std::uint16_t>(opcode & 0x0FFF);
+        ++m_edges[{m_frames[m_current].addr, callee}];
+
+        auto& children = m_frames[m_current].children;
+        auto it = std::find_if(children.begin(), children.end(), [&](const auto& c) {
+            return c.first == callee;
+        });
+        if (it != children.end()) {
+            m_current = it->second;
+        } else {
+            const auto index = static_cast<std::uint32_t>(m_frames.size());
+            children.emplace_back(callee, index);
+            m_frames.push_back(Frame{callee, m_current, 0, {}});
+            m_current = index;
+        }
+    } else if (op == Operation::ret && m_current != 0) {
+        // a return without a matching call (e.g. after attaching mid-run) stays at the root
+        m_current = m_frames[m_current].parent;
+    }
+}
+
+std::vector<Profiler::CallEdge> Profiler::call_edges() const
+{
+    std::vector<CallEdge> edges;
+    for (const auto& [edge, count] : m_edges) {
+        edges.push_back({edge.first, edge.second, count});
+    }
+    std::sort(edges.begin(), edges.end(), [](const CallEdge& a, const CallEdge& b) {
+        return a.count > b.count;
+    });
+    return edges;
+}
+
+void Profiler::write_flat(std::ostream& out, std::size_t top_addresses) const
+{
+    fmt::print(out, "{:<14} {:>14} {:>8} {:>12} {:>10}\n", "operation", "count", "%", "time ms", "ns/op");
+    std::vector<std::size_t> ops(m_op_counts.size());
+    std::iota(ops.begin(), ops.end(), 0);
+    std::stable_sort(ops.begin(), ops.end(), [&](std::size_t a, std::size_t b) {
+        return m_op_counts[a] > m_op_counts[b];
+    });
+    for (auto i : ops) {
+        if (!m_op_counts[i]) {
+            break;
+        }
+
+        const auto op = static_cast<Operation>(i);
+        if (timed(op)) {
+            const auto ns = static_cast<double>(m_op_times[i].count());
+            fmt::print(out, "{:<14} {:>14} {:>7.2f}% {:>12.3f} {:>10.1f}\n", name(op), m_op_counts[i],
+                       percent(m_op_counts[i], m_instructions), ns / 1e6, ns / m_op_counts[i]);
+        } else {
+            fmt::print(out, "{:<14} {:>14} {:>7.2f}%\n", name(op), m_op_counts[i], percent(m_op_counts[i], m_instructions));
+        }
+    }
+
+    fmt::print(out, "\n{:<14} {:>14} {:>8}\n", "address", "count", "%");
+    std::vector<std::uint16_t> addrs(m_pc_counts.size());
+    std::iota(addrs.begin(), addrs.end(), 0);
+    const auto top = std::min(top_addresses, addrs.size());
+    std::partial_sort(addrs.begin(), addrs.begin() + top, addrs.end(), [&](std::uint16_t a, std::uint16_t b) {
+        return m_pc_counts[a] > m_pc_counts[b];
+    });
+    for (std::size_t i = 0; i < top && m_pc_counts[addrs[i]]; i++) {
+        fmt::print(out, "{:#06x}         {:>14} {:>7.2f}%\n", addrs[i], m_pc_counts[addrs[i]], percent(m_pc_counts[addrs[i]], m_instructions));
+    }
+
+    const auto edges = call_edges();
+    if (!edges.empty()) {
+        fmt::print(out, "\n{:<14} {:>14}\n", "call", "count");
+        for (const auto& e : edges) {
+            fmt::print(out, "{:#05x} -> {:#05x} {:>14}\n", e.caller, e.callee, e.count);
+        }
+    }
+}
+
+void Profiler::write_folded(std::ostream& out) const
+{
+    // depth first, carrying the stack of the current node as text
+    std::vector<std::pair<std::uint32_t, std::string>> pending{{0, fmt::format("{:#05x}", entry_point)}};
+    while (!pending.empty()) {
+        auto [index, stack] = std::move(pending.back());
+        pending.pop_back();
+
+        const auto& frame = m_frames[index];
+        if (frame.self) {
+            fmt::print(out, "{} {}\n", stack, frame.self);
+        }
+        for (auto it = frame.children.rbegin(); it != frame.children.rend(); ++it) {
+            pending.emplace_back(it->second, fmt::format("{};{:#05x}", stack, it->first));
+        }
+    }
+}
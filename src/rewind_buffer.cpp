@@ -0,0 +1,109 @@
+#include "rewind_buffer.h"
+
+namespace
+{
+
+void put_varint(std::vector<std::uint8_t>& out, std::size_t v)
+{
+    while (v >= 0x80) {
+        out.push_back(static_cast<std::uint8_t>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<std::uint8_t>(v));
+}
+
+std::size_t get_varint(const std::uint8_t*& in)
+{
+    std::size_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        const auto byte = *in++;
+        v |= std::size_t{byte & 0x7Fu} << shift;
+        if (!(byte & 0x80)) {
+            return v;
+        }
+    }
+}
+
+// encodes from ^ to as alternating runs of unchanged bytes and XORed literals
+std::vector<std::uint8_t> encode_delta(const std::vector<std::uint8_t>& from, const std::vector<std::uint8_t>& to)
+{
+    std::vector<std::uint8_t> out;
+    const auto size = from.size();
+    std::size_t i = 0;
+    while (i < size) {
+        const auto run_start = i;
+        while (i < size && from[i] == to[i]) {
+            i++;
+        }
+        const auto literal_start = i;
+        while (i < size && from[i] != to[i]) {
+            i++;
+        }
+        put_varint(out, literal_start - run_start);
+        put_varint(out, i - literal_start);
+        for (auto j = literal_start; j < i; j++) {
+            out.push_back(from[j] ^ to[j]);
+        }
+    }
+    return out;
+}
+
+void apply_delta(std::vector<std::uint8_t>& state, const std::vector<std::uint8_t>& delta)
+{
+    const auto* in = delta.data();
+    const auto* end = in + delta.size();
+    std::size_t pos = 0;
+    while (in < end) {
+        pos += get_varint(in);
+        const auto literals = get_varint(in);
+        for (std::size_t j = 0; j < literals; j++) {
+            state[pos++] ^= *in++;
+        }
+    }
+}
+
+}
+
+RewindBuffer::RewindBuffer(std::size_t capacity_bytes)
+    : m_capacity(capacity_bytes)
+{
+}
+
+void RewindBuffer::push(const Chip8Cpu& chip8)
+{
+    auto state = chip8.save_state();
+    if (!m_current.empty() && m_current.size() == state.size()) {
+        auto delta = encode_delta(state, m_current);
+        m_bytes += delta.size();
+        m_deltas.push_back(std::move(delta));
+    } else {
+        clear();
+    }
+    m_current = std::move(state);
+
+    while (!m_deltas.empty() && memory_usage() > m_capacity) {
+        m_bytes -= m_deltas.front().size();
+        m_deltas.pop_front();
+    }
+}
+
+bool RewindBuffer::rewind(Chip8Cpu& chip8)
+{
+    if (m_deltas.empty()) {
+        return false;
+    }
+
+    apply_delta(m_current, m_deltas.back());
+    m_bytes -= m_deltas.back().size();
+    m_deltas.pop_back();
+
+    chip8.load_state(m_current);
+    return true;
+}
+
+void RewindBuffer::clear()
+{
+    m_deltas.clear();
+    m_current.clear();
+    m_bytes = 0;
+}
@@ -0,0 +1,180 @@
+#include "rom_library.h"
+
+#include <algorithm>
+#include <fstream>
+
+#include "chip8.h"
+
+namespace
+{
+
+constexpr char archive_magic[4] = {'C', '8', 'R', 'L'};
+constexpr std::uint8_t archive_version = 1;
+constexpr std::size_t header_size = sizeof(archive_magic) + 1 + 4;
+
+// after the header every ROM is a record of u16 name length, u32 size and u64 hash,
+// followed by the name and the data, all integers little endian
+constexpr std::size_t record_size = 2 + 4 + 8;
+
+// anything bigger can't be loaded by any profile, e.g. documentation next to the ROMs
+constexpr std::size_t max_rom_size = Chip8Cpu::max_memory_size - 0x200;
+
+template <class Int>
+void put_value(std::ostream& out, Int v)
+{
+    for (std::size_t i = 0; i < sizeof(Int); i++) {
+        out.put(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+template <class Int>
+Int get_value(const std::uint8_t* in)
+{
+    Int v = 0;
+    for (std::size_t i = 0; i < sizeof(Int); i++) {
+        v |= static_cast<Int>(Int{in[i]} << (8 * i));
+    }
+    return v;
+}
+
+// regular files below a directory in a stable order, so archives and indices don't depend on the file system
+std::vector<std::filesystem::path> list_files(const std::filesystem::path& directory)
+{
+    namespace fs = std::filesystem;
+
+    std::vector<fs::path> files;
+    for (const auto& entry : fs::recursive_directory_iterator(directory)) {
+        if (entry.is_regular_file() && entry.file_size() > 0 && entry.file_size() <= max_rom_size) {
+            files.push_back(entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+}
+
+std::uint64_t content_hash(utils::span<const std::uint8_t> data)
+{
+    std::uint64_t hash = 0xCBF29CE484222325;
+    for (auto byte : data) {
+        hash ^= byte;
+        hash *= 0x100000001B3;
+    }
+    return hash;
+}
+
+RomLibrary::RomLibrary(const std::filesystem::path& path)
+{
+    namespace fs = std::filesystem;
+
+    if (!fs::exists(path)) {
+        throw FileNotFoundException(path.u8string());
+    }
+
+    if (fs::is_directory(path)) {
+        for (const auto& file : list_files(path)) {
+            m_files.emplace_back(file);
+            const auto data = m_files.back().bytes();
+            add(file.lexically_relative(path).generic_u8string(), content_hash(data), data);
+        }
+        return;
+    }
+
+    m_files.emplace_back(path);
+    const auto data = m_files.back().bytes();
+    if (is_archive(data)) {
+        open_archive(data, path);
+    } else {
+        add(path.filename().u8string(), content_hash(data), data);
+    }
+}
+
+const RomLibrary::Rom* RomLibrary::find(std::uint64_t hash) const
+{
+    const auto it = m_by_hash.find(hash);
+    return it != m_by_hash.end() ? &m_roms[it->second] : nullptr;
+}
+
+const RomLibrary::Rom* RomLibrary::find(std::string_view name) const
+{
+    const auto it = m_by_name.find(std::string{name});
+    return it != m_by_name.end() ? &m_roms[it->second] : nullptr;
+}
+
+void RomLibrary::pack(const std::filesystem::path& directory, const std::filesystem::path& archive)
+{
+    const auto files = list_files(directory);
+
+    std::ofstream out(archive, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw IOException("Can't write file " + archive.u8string());
+    }
+
+    out.write(archive_magic, sizeof(archive_magic));
+    out.put(static_cast<char>(archive_version));
+    put_value(out, static_cast<std::uint32_t>(files.size()));
+    for (const auto& file : files) {
+        const utils::MappedFile mapped{file};
+        const auto data = mapped.bytes();
+        const auto name = file.lexically_relative(directory).generic_u8string();
+        put_value(out, static_cast<std::uint16_t>(name.size()));
+        put_value(out, static_cast<std::uint32_t>(data.size()));
+        put_value(out, content_hash(data));
+        out.write(name.data(), static_cast<std::streamsize>(name.size()));
+        out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+    }
+
+    if (!out.flush()) {
+        throw IOException("Can't write file " + archive.u8string());
+    }
+}
+
+bool RomLibrary::is_archive(utils::span<const std::uint8_t> data)
+{
+    return data.size() >= header_size && std::equal(archive_magic, archive_magic + sizeof(archive_magic), data.begin());
+}
+
+void RomLibrary::add(std::string name, std::uint64_t hash, utils::span<const std::uint8_t> data)
+{
+    const auto index = m_roms.size();
+    m_by_hash.emplace(hash, index);
+    m_by_name.emplace(name, index);
+    m_roms.push_back({std::move(name), hash, data});
+}
+
+void RomLibrary::open_archive(utils::span<const std::uint8_t> data, const std::filesystem::path& path)
+{
+    const auto* in = data.data() + sizeof(archive_magic);
+    const auto version = *in++;
+    if (version != archive_version) {
+        throw IOException("Unsupported ROM archive version {}", version);
+    }
+    const auto count = get_value<std::uint32_t>(in);
+    in += 4;
+
+    // the stored hashes are trusted, opening an archive doesn't read the ROMs themselves
+    const auto* end = data.end();
+    // every ROM takes at least a record, a corrupt count mustn't turn into a huge reservation
+    if (count > static_cast<std::size_t>(end - in) / record_size) {
+        throw IOException("ROM archive {} is truncated", path.u8string());
+    }
+    m_roms.reserve(m_roms.size() + count);
+    for (std::uint32_t i = 0; i < count; i++) {
+        if (static_cast<std::size_t>(end - in) < record_size) {
+            throw IOException("ROM archive {} is truncated", path.u8string());
+        }
+        const auto name_size = get_value<std::uint16_t>(in);
+        const auto size = get_value<std::uint32_t>(in + 2);
+        const auto hash = get_value<std::uint64_t>(in + 6);
+        in += record_size;
+        if (static_cast<std::size_t>(end - in) < std::size_t{name_size} + size) {
+            throw IOException("ROM archive {} is truncated", path.u8string());
+        }
+
+        std::string name(reinterpret_cast<const char*>(in), name_size);
+        in += name_size;
+        add(std::move(name), hash, {in, size});
+        in += size;
+    }
+}
@@ -0,0 +1,123 @@
+#include "scheduler.h"
+
+#include <algorithm>
+
+#include "audio.h"
+
+namespace
+{
+
+// never try to catch up with more than this after a stall, e.g. a dragged window
+constexpr std::chrono::milliseconds max_catch_up{250};
+
+// instructions run between two host clock checks in unlimited mode
+constexpr std::uint64_t unlimited_chunk = 1000;
+
+}
+
+Scheduler::Scheduler(Chip8Cpu& chip8, unsigned rate, bool unlimited)
+    : m_chip8(chip8)
+{
+    set_rate(rate, unlimited);
+}
+
+void Scheduler::set_rate(unsigned rate, bool unlimited)
+{
+    m_rate = std::max(rate, timer_rate);
+    m_unlimited = unlimited;
+    m_pending = 0;
+    m_timer_phase = 0;
+}
+
+void Scheduler::reset()
+{
+    m_cycles = 0;
+    m_pending = 0;
+    m_timer_phase = 0;
+}
+
+std::uint64_t Scheduler::advance(std::chrono::nanoseconds elapsed)
+{
+    if (m_unlimited) {
+        elapsed = std::min<std::chrono::nanoseconds>(elapsed, max_catch_up);
+        if (elapsed.count() <= 0) {
+            return 0;
+        }
+
+        using clock = std::chrono::steady_clock;
+        const auto deadline = clock::now() + elapsed;
+        std::uint64_t done = 0;
+        do {
+            done += run_cycles(unlimited_chunk);
+        } while (clock::now() < deadline);
+        return done;
+    }
+
+    return run_cycles(cycles_due(elapsed));
+}
+
+std::uint64_t Scheduler::cycles_due(std::chrono::nanoseconds elapsed)
+{
+    elapsed = std::min<std::chrono::nanoseconds>(elapsed, max_catch_up);
+    if (elapsed.count() <= 0) {
+        return 0;
+    }
+
+    constexpr std::uint64_t ns_per_second = 1000000000;
+    m_pending += static_cast<std::uint64_t>(elapsed.count()) * m_rate;
+    const auto cycles = m_pending / ns_per_second;
+    m_pending -= cycles * ns_per_second;
+    return cycles;
+}
+
+std::uint64_t Scheduler::run_cycles(std::uint64_t cycles)
+{
+    std::uint64_t done = 0;
+    while (done < cycles) {
+        const auto until_tick = (m_rate - m_timer_phase + timer_rate - 1) / timer_rate;
+        const auto budget = std::min(cycles - done, until_tick);
+        const auto result = m_chip8.try_run_until(budget, Chip8Cpu::stop_on_key_wait | Chip8Cpu::stop_on_exit);
+        if (result.reason == Chip8Cpu::StopReason::fault) {
+            done += result.cycles;
+            m_cycles += result.cycles;
+            m_chip8.throw_fault();
+        }
+
+        // a waiting FX0A would just spin until the keys change, which can't happen
+        // before the next timer tick, so the rest of the budget passes idle, as it
+        // does for a program halted by 00FD
+        const auto idle = result.reason == Chip8Cpu::StopReason::key_wait || result.reason == Chip8Cpu::StopReason::exit;
+        const auto n = idle ? budget : result.cycles;
+        done += n;
+        m_cycles += n;
+        m_timer_phase += n * timer_rate;
+        if (m_timer_phase >= m_rate) {
+            m_timer_phase -= m_rate;
+            if (m_audio) {
+                m_audio->tick(m_chip8);
+            }
+            m_chip8.count_down();
+        }
+    }
+    return done;
+}
+
+std::size_t Scheduler::run_events(std::uint64_t cycles, utils::span<const KeyEvent> events)
+{
+    const auto end = m_cycles + cycles;
+    std::size_t next = 0;
+    for (;;) {
+        for (; next < events.size() && events[next].cycle <= m_cycles; next++) {
+            m_chip8.keys[events[next].key] = events[next].down ? 1 : 0;
+        }
+        if (m_cycles >= end) {
+            return next;
+        }
+
+        auto stop = end;
+        if (next < events.size()) {
+            stop = std::min(stop, events[next].cycle);
+        }
+        run_cycles(stop - m_cycles);
+    }
+}
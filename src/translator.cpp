@@ -0,0 +1,346 @@
+#include "translator.h"
+
+#include <algorithm>
+#include <set>
+
+#include <fmt/format.h>
+#include <fmt/ostream.h>
+
+#include "code_map.h"
+#include "scheduler.h"
+
+namespace
+{
+
+using Operation = Chip8Cpu::Operation;
+using Quirks = Chip8Cpu::Quirks;
+
+constexpr std::uint16_t rom_start = 0x200;
+
+bool is_skip_on_registers(Operation op)
+{
+    switch (op) {
+    case Operation::se_imm:
+    case Operation::sne_imm:
+    case Operation::se_reg:
+    case Operation::sne_reg:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// instructions after which translated code goes back to the dispatcher: the
+// interpreter leaves pc wherever it ends up, or memory may no longer hold the rest
+bool leaves_block(Operation op)
+{
+    switch (op) {
+    case Operation::ret:
+    case Operation::jp:
+    case Operation::call:
+    case Operation::se_imm:
+    case Operation::sne_imm:
+    case Operation::se_reg:
+    case Operation::sne_reg:
+    case Operation::jp_v0:
+    case Operation::skp:
+    case Operation::sknp:
+    case Operation::ld_key:
+    case Operation::exit:
+    case Operation::invalid:
+    case Operation::sys:
+    case Operation::ld_bcd:
+    case Operation::ld_store:
+    case Operation::save_range:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// the statement for an instruction that can't fault and leaves pc alone, empty for the rest
+std::string inline_code(const Chip8Cpu::Instruction& ins, Quirks quirks)
+{
+    const auto x = ins.x;
+    const auto y = ins.y;
+    const auto flags = Chip8Cpu::quirk_flags(quirks);
+    const auto reset_vf = flags.logic_reset_vf ? " V[0xF] = 0;" : "";
+    const auto src = flags.shift_vy ? y : x;
+    switch (ins.op) {
+    case Operation::ld_imm: return fmt::format("V[0x{:X}] = {:#04x};", x, ins.nn);
+    case Operation::add_imm: return fmt::format("V[0x{:X}] += {:#04x};", x, ins.nn);
+    case Operation::ld_reg: return fmt::format("V[0x{:X}] = V[0x{:X}];", x, y);
+    case Operation::or_reg: return fmt::format("V[0x{:X}] |= V[0x{:X}];{}", x, y, reset_vf);
+    case Operation::and_reg: return fmt::format("V[0x{:X}] &= V[0x{:X}];{}", x, y, reset_vf);
+    case Operation::xor_reg: return fmt::format("V[0x{:X}] ^= V[0x{:X}];{}", x, y, reset_vf);
+    // VF first, like the handlers, so that VF as an operand behaves the same
+    case Operation::add_reg:
+        return fmt::format("V[0xF] = V[0x{1:X}] > 0xFF - V[0x{0:X}] ? 1 : 0; V[0x{0:X}] += V[0x{1:X}];", x, y);
+    // spelled out when both operands are the same register, compilers warn about comparing it with itself
+    case Operation::sub_reg:
+        if (x == y) {
+            return fmt::format("V[0xF] = 1; V[0x{:X}] = 0;", x);
+        }
+        return fmt::format("V[0xF] = V[0x{0:X}] < V[0x{1:X}] ? 0 : 1; V[0x{0:X}] -= V[0x{1:X}];", x, y);
+    case Operation::subn_reg:
+        if (x == y) {
+            return fmt::format("V[0xF] = 0; V[0x{:X}] = 0;", x);
+        }
+        return fmt::format("V[0xF] = V[0x{1:X}] < V[0x{0:X}] ? 1 : 0; V[0x{0:X}] = static_cast<std::uint8_t>(V[0x{1:X}] - V[0x{0:X}]);", x, y);
+    case Operation::shr:
+        return fmt::format("{{ const auto v = V[0x{1:X}]; V[0xF] = v & 0x01; V[0x{0:X}] = v >> 1; }}", x, src);
+    case Operation::shl:
+        return fmt::format("{{ const auto v = V[0x{1:X}]; V[0xF] = v >> 7; V[0x{0:X}] = static_cast<std::uint8_t>(v << 1); }}", x, src);
+    case Operation::ld_i: return fmt::format("I = {:#05x};", ins.nnn());
+    case Operation::rnd: return fmt::format("V[0x{:X}] = {:#04x} & n.random_byte();", x, ins.nn);
+    case Operation::ld_vx_dt: return fmt::format("V[0x{:X}] = n.delay_timer;", x);
+    case Operation::ld_dt: return fmt::format("n.delay_timer = V[0x{:X}];", x);
+    case Operation::ld_st: return fmt::format("n.sound_timer = V[0x{:X}];", x);
+    case Operation::add_i: return fmt::format("I += V[0x{:X}];", x);
+    default: return {};
+    }
+}
+
+std::string skip_condition(const Chip8Cpu::Instruction& ins)
+{
+    switch (ins.op) {
+    case Operation::se_imm: return fmt::format("V[0x{:X}] == {:#04x}", ins.x, ins.nn);
+    case Operation::sne_imm: return fmt::format("V[0x{:X}] != {:#04x}", ins.x, ins.nn);
+    case Operation::se_reg: return ins.x == ins.y ? "true" : fmt::format("V[0x{:X}] == V[0x{:X}]", ins.x, ins.y);
+    default: return ins.x == ins.y ? "false" : fmt::format("V[0x{:X}] != V[0x{:X}]", ins.x, ins.y);
+    }
+}
+
+}
+
+Translator::Translator(utils::span<const std::uint8_t> rom, Chip8Cpu::Quirks quirks, utils::span<const std::uint16_t> entries)
+    : m_rom(rom.begin(), rom.end()), m_quirks(quirks)
+{
+    if (m_rom.empty()) {
+        throw IOException("Can't translate an empty ROM");
+    }
+
+    Chip8Cpu chip8;
+    chip8.set_quirks(quirks);
+    chip8.load_rom(rom);
+    const auto memory = chip8.memory_view();
+    m_memory.assign(memory.begin(), memory.end());
+
+    // a map per entry point; code reached from several of them is translated once per
+    // block start, blocks that overlap are fine as each one checks its own bytes
+    std::vector<CodeMap> maps{CodeMap{chip8}};
+    for (const auto entry : entries) {
+        maps.emplace_back(memory, quirks, entry);
+    }
+
+    // only code inside the ROM is translated, the generated program can't know what else memory holds
+    const auto rom_end = rom_start + static_cast<std::uint32_t>(m_rom.size());
+    std::set<std::uint16_t> starts;
+    const auto add = [&](Segment&& segment) {
+        if (!segment.instructions.empty() && starts.insert(segment.start).second) {
+            m_segments.push_back(std::move(segment));
+        }
+    };
+    for (const auto& map : maps) {
+        for (const auto& block : map.blocks()) {
+            if (starts.count(block.start)) {
+                continue;
+            }
+
+            Segment segment{block.start, block.start, {}};
+            for (std::uint32_t addr = block.start; addr < block.end;) {
+                const auto length = length_at(addr);
+                if (addr < rom_start || addr + length > rom_end) {
+                    break;
+                }
+                segment.instructions.push_back(static_cast<std::uint16_t>(addr));
+                addr += length;
+                segment.end = static_cast<std::uint16_t>(addr);
+
+                // memory writes and FX0A end the block early, what follows becomes a block of its own
+                if (leaves_block(Chip8Cpu::decode(opcode_at(segment.instructions.back()), quirks).op) && addr < block.end) {
+                    add(std::move(segment));
+                    segment = {static_cast<std::uint16_t>(addr), static_cast<std::uint16_t>(addr), {}};
+                }
+            }
+            add(std::move(segment));
+        }
+    }
+    std::sort(m_segments.begin(), m_segments.end(), [](const Segment& a, const Segment& b) {
+        return a.start < b.start;
+    });
+}
+
+std::vector<std::uint16_t> Translator::trace_jumps(utils::span<const std::uint8_t> rom, Chip8Cpu::Quirks quirks, std::uint64_t frames)
+{
+    Chip8Cpu chip8;
+    chip8.set_quirks(quirks);
+    chip8.load_rom(rom);
+
+    std::set<std::uint16_t> targets;
+    constexpr auto ipf = Scheduler::default_rate / Scheduler::timer_rate;
+    for (std::uint64_t frame = 0; frame < frames; frame++) {
+        for (unsigned i = 0; i < ipf; i++) {
+            const auto pc = chip8.program_counter();
+            const auto memory = chip8.memory_view();
+            const bool indirect = pc + 1u < memory.size()
+                && Chip8Cpu::decode(static_cast<std::uint16_t>(memory[pc] << 8 | memory[pc + 1]), quirks).op == Operation::jp_v0;
+            if (chip8.try_step() != Chip8Cpu::Fault::none) {
+                return {targets.begin(), targets.end()};
+            }
+            if (indirect) {
+                targets.insert(chip8.program_counter());
+            }
+        }
+        chip8.count_down();
+    }
+    return {targets.begin(), targets.end()};
+}
+
+std::size_t Translator::instructions() const noexcept
+{
+    std::size_t count = 0;
+    for (const auto& segment : m_segments) {
+        count += segment.instructions.size();
+    }
+    return count;
+}
+
+std::uint16_t Translator::opcode_at(std::uint32_t addr) const noexcept
+{
+    if (addr + 1 >= m_memory.size()) {
+        return 0;
+    }
+    return static_cast<std::uint16_t>(m_memory[addr] << 8 | m_memory[addr + 1]);
+}
+
+std::uint32_t Translator::length_at(std::uint32_t addr) const noexcept
+{
+    return Chip8Cpu::decode(opcode_at(addr), m_quirks).op == Operation::ld_i_long ? 4 : 2;
+}
+
+bool Translator::is_translated(std::uint32_t addr) const noexcept
+{
+    const auto it = std::lower_bound(m_segments.begin(), m_segments.end(), addr, [](const Segment& s, std::uint32_t a) {
+        return s.start < a;
+    });
+    return it != m_segments.end() && it->start == addr;
+}
+
+std::uint32_t Translator::skip_target(std::uint32_t addr) const noexcept
+{
+    // as Chip8Cpu::skip_next(): on XO-CHIP a skip jumps over both words of F000 NNNN
+    const auto next = addr + 2;
+    if (Chip8Cpu::quirk_flags(m_quirks).long_skips && next + 1 < m_memory.size() && opcode_at(next) == 0xF000) {
+        return next + 4;
+    }
+    return next + 2;
+}
+
+void Translator::write(std::ostream& out, const std::string& symbol, const std::string& name) const
+{
+    const auto rom_end = rom_start + static_cast<std::uint32_t>(m_rom.size());
+    const auto long_skips = Chip8Cpu::quirk_flags(m_quirks).long_skips;
+    std::set<std::uint32_t> labels;
+
+    // control goes straight on to translated code, through the dispatcher otherwise
+    const auto transfer = [&](std::uint32_t target) {
+        if (is_translated(target)) {
+            labels.insert(target);
+            return fmt::format("pc = {0:#06x}; goto at_{0:04x};", target);
+        }
+        return fmt::format("pc = {:#06x}; continue;", target);
+    };
+
+    std::vector<std::string> bodies;
+    for (const auto& segment : m_segments) {
+        std::string body;
+        const auto count = segment.instructions.size();
+        auto checked_end = std::uint32_t{segment.end};
+
+        for (std::size_t i = 0; i < count; i++) {
+            const auto addr = segment.instructions[i];
+            const auto opcode = opcode_at(addr);
+            const auto ins = Chip8Cpu::decode(opcode, m_quirks);
+            const auto next = addr + length_at(addr);
+            const auto comment = CodeMap::disassemble(opcode, m_quirks, opcode_at(addr + 2));
+            const auto interpret = fmt::format("if (!n.interpret({:#06x})) {{ return n.stop(done + {}); }}", addr, i);
+            const bool last = i + 1 == count;
+
+            std::string code;
+            if (auto inlined = inline_code(ins, m_quirks); !inlined.empty()) {
+                code = std::move(inlined);
+                if (last) {
+                    code += fmt::format(" done += {}; {}", count, transfer(next));
+                }
+            } else if (ins.op == Operation::jp) {
+                code = fmt::format("done += {}; {}", count, transfer(ins.nnn()));
+            } else if (ins.op == Operation::call) {
+                code = fmt::format("if (!n.call({:#06x}, {:#05x})) {{ return n.stop(done + {}); }} done += {}; {}",
+                                   addr, ins.nnn(), i, count, transfer(ins.nnn()));
+            } else if (ins.op == Operation::ret) {
+                code = fmt::format("if (!n.ret({:#06x})) {{ return n.stop(done + {}); }} done += {}; continue;", addr, i, count);
+            } else if (is_skip_on_registers(ins.op) && (!long_skips || addr + 4u <= rom_end)) {
+                // whether the skip covers four bytes depends on the word after it, which has to stay the same too
+                if (long_skips) {
+                    checked_end = std::max(checked_end, addr + 4u);
+                }
+                code = fmt::format("done += {}; if ({}) {{ {} }} {}", count, skip_condition(ins), transfer(skip_target(addr)), transfer(next));
+            } else if (leaves_block(ins.op) || last) {
+                code = fmt::format("{} done += {}; continue;", interpret, count);
+            } else {
+                code = interpret;
+            }
+            body += fmt::format("            {}  // {:04x} {}\n", code, addr, comment);
+        }
+
+        const auto head = fmt::format("            if (cycles - done < {} || !n.unchanged({:#06x}, rom + {:#05x}, {})) {{\n"
+                                      "                break;\n"
+                                      "            }}\n",
+                                      count, segment.start, segment.start - rom_start, checked_end - segment.start);
+        bodies.push_back(head + body);
+    }
+
+    fmt::print(out, "// Generated by chip8_aot from {}, quirks {}: {} blocks, {} instructions\n\n",
+               name, Chip8Cpu::quirks_name(m_quirks), blocks(), instructions());
+    fmt::print(out, "#include <cstdint>\n\n#include <chip8/native.h>\n\nnamespace\n{{\n\n");
+
+    fmt::print(out, "const std::uint8_t rom[] = {{");
+    for (std::size_t i = 0; i < m_rom.size(); i++) {
+        fmt::print(out, "{}{:#04x},", i % 16 ? " " : "\n    ", m_rom[i]);
+    }
+    fmt::print(out, "\n}};\n\n");
+
+    fmt::print(out, "Chip8Cpu::RunResult run(Chip8Cpu::Native& n, std::uint64_t cycles)\n{{\n");
+    fmt::print(out, "    [[maybe_unused]] auto* const V = n.V;\n");
+    fmt::print(out, "    [[maybe_unused]] auto& I = n.I;\n");
+    fmt::print(out, "    auto& pc = n.pc;\n");
+    fmt::print(out, "    std::uint64_t done = 0;\n\n");
+    fmt::print(out, "    while (done < cycles) {{\n");
+    fmt::print(out, "        switch (pc) {{\n");
+    for (std::size_t s = 0; s < m_segments.size(); s++) {
+        const auto start = m_segments[s].start;
+        fmt::print(out, "        case {:#06x}:\n", start);
+        if (labels.count(start)) {
+            fmt::print(out, "        at_{:04x}:\n", start);
+        }
+        fmt::print(out, "{}", bodies[s]);
+    }
+    fmt::print(out, "        default:\n            break;\n        }}\n\n");
+    fmt::print(out, "        // not translated, overwritten since or longer than the cycles left; jumps\n");
+    fmt::print(out, "        // between blocks skip the loop condition, so the budget may be used up\n");
+    fmt::print(out, "        if (done == cycles) {{\n            break;\n        }}\n");
+    fmt::print(out, "        if (!n.step()) {{\n            return n.stop(done);\n        }}\n        ++done;\n    }}\n");
+    fmt::print(out, "    return n.finish(done);\n}}\n\n}}\n\n");
+
+    fmt::print(out, "extern const NativeProgram {};\n", symbol);
+    std::string literal;
+    for (const auto c : name) {
+        if (c == '"' || c == '\\') {
+            literal += '\\';
+        }
+        literal += c;
+    }
+    fmt::print(out, "const NativeProgram {} = {{\"{}\", Chip8Cpu::Quirks::{}, {{rom, sizeof(rom)}}, &run}};\n",
+               symbol, literal, Chip8Cpu::quirks_name(m_quirks));
+}
@@ -0,0 +1,130 @@
+#include "utils/mapped_file.h"
+
+#include <utility>
+
+#include "exceptions.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+namespace utils
+{
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+    const auto file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw FileNotFoundException(path.u8string());
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw IOException("Can't read file " + path.u8string());
+    }
+    if (size.QuadPart == 0) {
+        CloseHandle(file);
+        return;
+    }
+
+    // the view keeps the mapping and the file alive, their handles aren't needed afterwards
+    const auto mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        throw IOException("Can't map file " + path.u8string());
+    }
+    const auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        throw IOException("Can't map file " + path.u8string());
+    }
+
+    m_data = static_cast<const std::uint8_t*>(view);
+    m_size = static_cast<std::size_t>(size.QuadPart);
+}
+
+void MappedFile::unmap() noexcept
+{
+    if (m_data) {
+        UnmapViewOfFile(m_data);
+    }
+}
+
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace utils
+{
+
+MappedFile::MappedFile(const std::filesystem::path& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw FileNotFoundException(path.u8string());
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        throw IOException("Can't read file " + path.u8string());
+    }
+    if (st.st_size == 0) {
+        ::close(fd);
+        return;
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    void* data = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        throw IOException("Can't map file " + path.u8string());
+    }
+
+    m_data = static_cast<const std::uint8_t*>(data);
+    m_size = static_cast<std::size_t>(st.st_size);
+}
+
+void MappedFile::unmap() noexcept
+{
+    if (m_data) {
+        ::munmap(const_cast<std::uint8_t*>(m_data), m_size);
+    }
+}
+
+}
+
+#endif // defined(_WIN32)
+
+namespace utils
+{
+
+MappedFile::~MappedFile()
+{
+    unmap();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr)), m_size(std::exchange(other.m_size, 0))
+{
+}
+
+MappedFile& MappedFile::operator =(MappedFile&& other) noexcept
+{
+    if (this != &other) {
+        unmap();
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+    }
+    return *this;
+}
+
+}